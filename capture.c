@@ -0,0 +1,296 @@
+// capture.c
+// Author: Rohith Kotia Palakirti
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include "capture.h"
+
+// Initial size of each of the buffers records are collected in
+#define CAPTURE_BUFFER (1 << 20)
+// Records buffered before the writer thread is woken early
+#define CAPTURE_WRITE_AT (CAPTURE_BUFFER / 2)
+// Longest time a record is buffered before it is written out
+#define CAPTURE_FLUSH_NS 1000000000L
+// Longest encoding of a 64 bit varint
+#define VARINT_MAX 10
+
+/*
+ * Function Prototypes
+ */
+static void* capture_writer(void* arg);
+static void write_all(int fd, const char* buf, size_t len);
+static size_t put_varint(unsigned char* buf, uint64_t value);
+static int get_varint(FILE* file, uint64_t* value);
+
+/* Capture* capture_create(const char* path, uint64_t nowNs)
+* -----------------------------------------------
+* Creates (or truncates) a capture file, writes its header and starts the
+* thread that writes the records out
+*
+* path: path of the capture file
+* nowNs: the current time (ns, CLOCK_MONOTONIC)
+*
+* Returns: the new Capture, or NULL if the file can't be created
+*/
+Capture* capture_create(const char* path, uint64_t nowNs) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return NULL;
+    }
+    Capture* cap = malloc(sizeof(Capture));
+    cap->fd = fd;
+    pthread_mutex_init(&cap->lock, NULL);
+    pthread_mutex_init(&cap->writeLock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cap->ready, &attr);
+    pthread_condattr_destroy(&attr);
+    cap->size = cap->spareSize = CAPTURE_BUFFER;
+    cap->buf = malloc(cap->size);
+    cap->spare = malloc(cap->spareSize);
+    memcpy(cap->buf, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+    cap->len = CAPTURE_MAGIC_LEN;
+    cap->startNs = nowNs;
+    cap->lastUs = 0;
+    // The writer leaves every signal to the threads that expect them
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t threadId;
+    pthread_create(&threadId, NULL, capture_writer, cap);
+    pthread_detach(threadId);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return cap;
+}
+
+/* void capture_record(Capture* cap, uint64_t nowNs, uint32_t conn,
+*         int type, const char* line, size_t len)
+* -----------------------------------------------
+* Appends a record to a capture. The record is only copied into memory; the
+* writer thread writes it out within CAPTURE_FLUSH_NS. If the writer falls
+* behind, the buffer grows rather than making the caller (which may hold
+* the server's guard) wait for the disk.
+*
+* cap: the Capture
+* nowNs: the time of the event (ns, CLOCK_MONOTONIC)
+* conn: ID of the connection
+* type: CAPTURE_OPEN, CAPTURE_LINE or CAPTURE_CLOSE
+* line: the line sent, for CAPTURE_LINE
+* len: length of line
+*/
+void capture_record(Capture* cap, uint64_t nowNs, uint32_t conn, int type,
+        const char* line, size_t len) {
+    unsigned char head[3 * VARINT_MAX];
+    uint64_t us = (nowNs - cap->startNs) / 1000;
+    pthread_mutex_lock(&cap->lock);
+    // Threads can take the lock in a different order to their clock reads
+    us = (us > cap->lastUs) ? us : cap->lastUs;
+    size_t n = put_varint(head, us - cap->lastUs);
+    n += put_varint(head + n, conn);
+    n += put_varint(head + n, ((uint64_t) len << 2) | type);
+    if (cap->len + n + len > cap->size) {
+        while (cap->len + n + len > cap->size) {
+            cap->size *= 2;
+        }
+        cap->buf = realloc(cap->buf, cap->size);
+    }
+    memcpy(cap->buf + cap->len, head, n);
+    if (len > 0) {
+        memcpy(cap->buf + cap->len + n, line, len);
+    }
+    bool wasWaiting = cap->len < CAPTURE_WRITE_AT;
+    cap->len += n + len;
+    cap->lastUs = us;
+    if (wasWaiting && cap->len >= CAPTURE_WRITE_AT) {
+        pthread_cond_signal(&cap->ready);
+    }
+    pthread_mutex_unlock(&cap->lock);
+}
+
+/* void capture_close(Capture* cap)
+* -----------------------------------------------
+* Writes out every record made so far and closes the capture file, for use
+* when the server is about to exit. The writer thread is left waiting, and
+* records made afterwards are dropped.
+*
+* cap: the Capture
+*/
+void capture_close(Capture* cap) {
+    pthread_mutex_lock(&cap->writeLock);
+    pthread_mutex_lock(&cap->lock);
+    write_all(cap->fd, cap->buf, cap->len);
+    cap->len = 0;
+    close(cap->fd);
+    pthread_mutex_unlock(&cap->lock);
+}
+
+/* static void* capture_writer(void* arg)
+* -----------------------------------------------
+* Thread function that writes a capture's records out. It wakes once
+* CAPTURE_FLUSH_NS has passed or CAPTURE_WRITE_AT bytes are waiting, swaps
+* the buffers so recording can carry on, and writes the full one without
+* holding the lock.
+*
+* arg: the Capture
+*
+* Returns: NULL (never returns)
+*/
+static void* capture_writer(void* arg) {
+    Capture* cap = arg;
+    pthread_mutex_lock(&cap->lock);
+    while (1) {
+        struct timespec due;
+        clock_gettime(CLOCK_MONOTONIC, &due);
+        due.tv_nsec += CAPTURE_FLUSH_NS;
+        due.tv_sec += due.tv_nsec / 1000000000L;
+        due.tv_nsec %= 1000000000L;
+        while (cap->len < CAPTURE_WRITE_AT && pthread_cond_timedwait(
+                &cap->ready, &cap->lock, &due) != ETIMEDOUT) {
+        }
+        if (cap->len == 0) {
+            continue;
+        }
+        // Taken before the swap so buffers reach the file in the order they
+        // were filled, even with capture_close() writing the last one
+        pthread_mutex_unlock(&cap->lock);
+        pthread_mutex_lock(&cap->writeLock);
+        pthread_mutex_lock(&cap->lock);
+        char* full = cap->buf;
+        size_t fullLen = cap->len;
+        size_t fullSize = cap->size;
+        cap->buf = cap->spare;
+        cap->size = cap->spareSize;
+        cap->len = 0;
+        cap->spare = full;
+        cap->spareSize = fullSize;
+        pthread_mutex_unlock(&cap->lock);
+        write_all(cap->fd, full, fullLen);
+        pthread_mutex_unlock(&cap->writeLock);
+        pthread_mutex_lock(&cap->lock);
+    }
+    return NULL;
+}
+
+/* static void write_all(int fd, const char* buf, size_t len)
+* -----------------------------------------------
+* Writes the whole of buf to a file, giving up on error
+*
+* fd: the file to write to
+* buf: the data to write
+* len: length of buf in bytes
+*/
+static void write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += written;
+        len -= written;
+    }
+}
+
+/* int capture_check(FILE* file)
+* -----------------------------------------------
+* Reads and checks the header of a capture file
+*
+* file: the capture file, at its start
+*
+* Returns: 1 if it is a capture file this version can read, 0 otherwise
+*/
+int capture_check(FILE* file) {
+    char magic[CAPTURE_MAGIC_LEN];
+    return fread(magic, 1, CAPTURE_MAGIC_LEN, file) == CAPTURE_MAGIC_LEN
+            && memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) == 0;
+}
+
+/* int capture_read(FILE* file, CaptureEvent* event)
+* -----------------------------------------------
+* Reads the next record from a capture file. event->timeUs must hold the
+* time of the previous record (0 before the first).
+*
+* file: the capture file
+* event: populated with the record; the line is newly allocated and must be
+*        freed by the caller
+*
+* Returns: 1 on success, 0 at the end of the file or if the rest of it is
+*          truncated or corrupt
+*/
+int capture_read(FILE* file, CaptureEvent* event) {
+    uint64_t delta, conn, lenType;
+    if (!get_varint(file, &delta) || !get_varint(file, &conn)
+            || !get_varint(file, &lenType)) {
+        return 0;
+    }
+    event->timeUs += delta;
+    event->conn = conn;
+    event->type = lenType & 3;
+    event->len = lenType >> 2;
+    event->line = NULL;
+    if (event->type == CAPTURE_LINE) {
+        event->line = malloc(event->len + 1);
+        if (fread(event->line, 1, event->len, file) != event->len) {
+            free(event->line);
+            return 0;
+        }
+        event->line[event->len] = '\0';
+    }
+    return event->type <= CAPTURE_CLOSE;
+}
+
+/* static size_t put_varint(unsigned char* buf, uint64_t value)
+* -----------------------------------------------
+* Encodes a value 7 bits per byte, least significant first, with the top
+* bit of each byte set if another follows
+*
+* buf: where to write the encoding (at least VARINT_MAX bytes)
+* value: the value to encode
+*
+* Returns: number of bytes written
+*/
+static size_t put_varint(unsigned char* buf, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buf[n++] = value;
+    return n;
+}
+
+/* static int get_varint(FILE* file, uint64_t* value)
+* -----------------------------------------------
+* Decodes a value written by put_varint()
+*
+* file: the file to read from
+* value: set to the decoded value
+*
+* Returns: 1 on success, 0 at the end of the file or on a bad encoding
+*/
+static int get_varint(FILE* file, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 7 * VARINT_MAX; shift += 7) {
+        int c = getc(file);
+        if (c == EOF) {
+            return 0;
+        }
+        *value |= (uint64_t) (c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+// capture.h
+// Author: Rohith Kotia Palakirti
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// First bytes of every capture file (the last one is the format version)
+#define CAPTURE_MAGIC "PSCAP\0\0\1"
+#define CAPTURE_MAGIC_LEN 8
+
+// Events recorded in a capture
+#define CAPTURE_OPEN 0
+#define CAPTURE_LINE 1
+#define CAPTURE_CLOSE 2
+
+/* Capture Struct
+* -----------------------------------------------
+* A capture file being written by the server. Each record is three varints
+* (microseconds since the previous record, connection ID, and the line
+* length shifted left two bits with the event in the low two bits) followed
+* by the line, so a typical command costs 4-5 bytes more than its text.
+* Records are only copied into buf by the threads that record them; a
+* writer thread of its own swaps buf for spare and writes it to the file,
+* so recording never waits for the disk.
+* fd: the capture file
+* lock: held while a record is added or the buffers are swapped
+* writeLock: held while a buffer is written to the file
+* ready: signalled when buf is worth writing before the next flush is due
+* buf, len, size: records waiting for the writer thread, and room in buf
+* spare, spareSize: the buffer the writer thread last wrote, and its room
+* startNs: time (ns, CLOCK_MONOTONIC) the capture started
+* lastUs: time of the last record, in us since startNs
+*/
+typedef struct Capture {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_mutex_t writeLock;
+    pthread_cond_t ready;
+    char* buf;
+    size_t len;
+    size_t size;
+    char* spare;
+    size_t spareSize;
+    uint64_t startNs;
+    uint64_t lastUs;
+} Capture;
+
+/* CaptureEvent Struct
+* -----------------------------------------------
+* A record read back from a capture file
+* timeUs: time of the event, in us since the capture started
+* conn: ID of the connection
+* type: CAPTURE_OPEN, CAPTURE_LINE or CAPTURE_CLOSE
+* line: the line sent (without its newline), NULL unless type is
+*       CAPTURE_LINE
+* len: length of line
+*/
+typedef struct CaptureEvent {
+    uint64_t timeUs;
+    uint32_t conn;
+    int type;
+    char* line;
+    size_t len;
+} CaptureEvent;
+
+/*
+ * Function Prototypes
+ */
+Capture* capture_create(const char* path, uint64_t nowNs);
+void capture_record(Capture* cap, uint64_t nowNs, uint32_t conn, int type,
+        const char* line, size_t len);
+void capture_close(Capture* cap);
+int capture_check(FILE* file);
+int capture_read(FILE* file, CaptureEvent* event);
+
+#endif
@@ -0,0 +1,151 @@
+// delimbench.c
+// Author: Rohith Kotia Palakirti
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <csse2310a3.h>
+#include "delimscan.h"
+
+// Bytes processed per measurement, divided between its iterations
+#define BENCH_BYTES 200000000L
+
+/*
+ * Function Prototypes
+ */
+int old_is_valid_string(char* s);
+size_t old_frame_split(char* line, size_t len);
+size_t new_frame_split(char* line, size_t len);
+double now_secs(void);
+
+/* int main(int argc, char *argv[])
+* -----------------------------------------------
+* Times the command parsing done before delim_scan() against delim_scan()
+* for a range of payload sizes, printing nanoseconds per call:
+*   is_valid_string  the old three strchr() calls and the new single pass,
+*                    on a valid name of that size
+*   frame+split      finding the newline of "pub topic <payload>\n" and
+*                    splitting it with split_by_char(), and the same done
+*                    with one delim_scan()
+*
+* argc: count of number of commandline arguments
+* argv: the array of commandline arguments stored as strings
+*
+* Usage: delimbench [size ...] (default 16 256 4096 65536)
+*
+* Returns: 0
+*/
+int main(int argc, char* argv[]) {
+    size_t defaults[] = {16, 256, 4096, 65536};
+    int count = (argc > 1) ? argc - 1 : 4;
+    volatile size_t sink = 0; // Keeps the calls from being optimised away
+    printf("payload   is_valid_string old/new (ns)   "
+            "frame+split old/new (ns)\n");
+    for (int k = 0; k < count; k++) {
+        size_t n = (argc > 1) ? strtoul(argv[k + 1], NULL, 10) : defaults[k];
+        if (n == 0) {
+            continue;
+        }
+        long iters = BENCH_BYTES / n;
+        char* name = malloc(n + 1);
+        memset(name, 'a', n);
+        name[n] = '\0';
+        size_t len = n + strlen("pub topic \n");
+        char* line = malloc(len + 1);
+        sprintf(line, "pub topic %s\n", name);
+        char* work = malloc(len + 1);
+        double times[4];
+        double t = now_secs();
+        for (long i = 0; i < iters; i++) {
+            sink += old_is_valid_string(name);
+        }
+        times[0] = now_secs() - t;
+        t = now_secs();
+        for (long i = 0; i < iters; i++) {
+            sink += is_valid_string(name);
+        }
+        times[1] = now_secs() - t;
+        t = now_secs();
+        for (long i = 0; i < iters; i++) {
+            memcpy(work, line, len + 1);
+            sink += old_frame_split(work, len);
+        }
+        times[2] = now_secs() - t;
+        t = now_secs();
+        for (long i = 0; i < iters; i++) {
+            memcpy(work, line, len + 1);
+            sink += new_frame_split(work, len);
+        }
+        times[3] = now_secs() - t;
+        printf("%-9zu %11.1f / %-14.1f %11.1f / %.1f\n", n,
+                times[0] / iters * 1e9, times[1] / iters * 1e9,
+                times[2] / iters * 1e9, times[3] / iters * 1e9);
+        free(name);
+        free(line);
+        free(work);
+    }
+    return 0;
+}
+
+/* int old_is_valid_string(char* s)
+* -----------------------------------------------
+* is_valid_string() as it was before delim_scan(): one strchr() per
+* delimiter
+*
+* s: string to be checked
+*
+* Returns: 1 if s contains no space, colon or newline, 0 otherwise
+*/
+int old_is_valid_string(char* s) {
+    return !(strchr(s, ' ') || strchr(s, ':') || strchr(s, '\n'));
+}
+
+/* size_t old_frame_split(char* line, size_t len)
+* -----------------------------------------------
+* Frames and splits a pub command as psserver did before delim_scan():
+* memchr() for the newline, then split_by_char() for the command and for
+* the topic
+*
+* line: the command, which is modified
+* len: length of line in bytes
+*
+* Returns: length of the payload
+*/
+size_t old_frame_split(char* line, size_t len) {
+    char* newline = memchr(line, '\n', len);
+    *newline = '\0';
+    char** command = split_by_char(line, ' ', 2);
+    char** args = split_by_char(command[1], ' ', 2);
+    size_t payloadLen = strlen(args[1]);
+    free(command);
+    free(args);
+    return payloadLen;
+}
+
+/* size_t new_frame_split(char* line, size_t len)
+* -----------------------------------------------
+* Frames and splits a pub command with one delim_scan()
+*
+* line: the command
+* len: length of line in bytes
+*
+* Returns: length of the payload
+*/
+size_t new_frame_split(char* line, size_t len) {
+    DelimScan scan;
+    delim_scan_init(&scan);
+    size_t end = delim_scan(line, 0, len, &scan);
+    return end - scan.space[1] - 1;
+}
+
+/* double now_secs(void)
+* -----------------------------------------------
+* Returns: the current monotonic time in seconds
+*/
+double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
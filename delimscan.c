@@ -0,0 +1,298 @@
+// delimscan.c
+// Author: Rohith Kotia Palakirti
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "delimscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DELIM_X86
+#endif
+
+/*
+ * Function Prototypes
+ */
+static void note_space(DelimScan* scan, size_t pos);
+static void note_masks(DelimScan* scan, size_t base, uint32_t spaces,
+        uint32_t colons);
+static size_t scan_scalar(const char* buf, size_t start, size_t len,
+        DelimScan* scan);
+static int valid_scalar(const char* s);
+#ifdef DELIM_X86
+static size_t scan_sse2(const char* buf, size_t start, size_t len,
+        DelimScan* scan);
+static size_t scan_avx2(const char* buf, size_t start, size_t len,
+        DelimScan* scan);
+static int valid_sse2(const char* s);
+static int valid_avx2(const char* s);
+#endif
+
+/* void delim_scan_init(DelimScan* scan)
+* -----------------------------------------------
+* Initializes a DelimScan before the first delim_scan() of a line
+*
+* scan: the DelimScan to be initialized
+*/
+void delim_scan_init(DelimScan* scan) {
+    scan->space[0] = scan->space[1] = scan->colon = DELIM_NONE;
+}
+
+/* size_t delim_scan(const char* buf, size_t start, size_t len,
+*         DelimScan* scan)
+* -----------------------------------------------
+* Finds the end of a line and the spaces and colons in it in a single pass,
+* 32 or 16 bytes at a time where AVX2 or SSE2 are available. Delimiters
+* after the newline are ignored. A line received in pieces can be scanned a
+* piece at a time by passing the same DelimScan and the offset to resume at.
+*
+* buf: the buffer to be scanned
+* start: offset in buf to start scanning at
+* len: length of buf in bytes
+* scan: updated with any delimiters found that weren't already recorded
+*
+* Returns: the offset of the first newline at or after start, or len if
+*          there is none
+*/
+size_t delim_scan(const char* buf, size_t start, size_t len, DelimScan* scan) {
+#ifdef DELIM_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return scan_avx2(buf, start, len, scan);
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return scan_sse2(buf, start, len, scan);
+    }
+#endif
+    return scan_scalar(buf, start, len, scan);
+}
+
+/* int is_valid_string(char* s)
+* -----------------------------------------------
+* Checks if the passed string is valid or not, i.e. contains no space, colon
+* or newline. The string is read once, stopping at the first of these or
+* the terminating NUL, 32 or 16 bytes at a time where AVX2 or SSE2 are
+* available.
+*
+* s: string to be checked
+*
+* Returns: 0, if invalid
+*          1, if valid
+*/
+int is_valid_string(char* s) {
+#ifdef DELIM_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return valid_avx2(s);
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return valid_sse2(s);
+    }
+#endif
+    return valid_scalar(s);
+}
+
+/* static void note_space(DelimScan* scan, size_t pos)
+* -----------------------------------------------
+* Records a space unless two have already been found
+*/
+static void note_space(DelimScan* scan, size_t pos) {
+    if (scan->space[0] == DELIM_NONE) {
+        scan->space[0] = pos;
+    } else if (scan->space[1] == DELIM_NONE) {
+        scan->space[1] = pos;
+    }
+}
+
+/* static void note_masks(DelimScan* scan, size_t base, uint32_t spaces,
+*         uint32_t colons)
+* -----------------------------------------------
+* Records the spaces and colons flagged in a block's comparison masks
+*
+* scan: the DelimScan to update
+* base: offset of the block
+* spaces: bit i set if byte base + i is a space
+* colons: bit i set if byte base + i is a colon
+*/
+static void note_masks(DelimScan* scan, size_t base, uint32_t spaces,
+        uint32_t colons) {
+    while (spaces && scan->space[1] == DELIM_NONE) {
+        note_space(scan, base + __builtin_ctz(spaces));
+        spaces &= spaces - 1;
+    }
+    if (colons && scan->colon == DELIM_NONE) {
+        scan->colon = base + __builtin_ctz(colons);
+    }
+}
+
+/* static size_t scan_scalar(const char* buf, size_t start, size_t len,
+*         DelimScan* scan)
+* -----------------------------------------------
+* Byte at a time version of delim_scan(), also used for the tail of a buffer
+* too short for a vector
+*/
+static size_t scan_scalar(const char* buf, size_t start, size_t len,
+        DelimScan* scan) {
+    for (size_t i = start; i < len; i++) {
+        if (buf[i] == '\n') {
+            return i;
+        } else if (buf[i] == ' ') {
+            note_space(scan, i);
+        } else if (buf[i] == ':' && scan->colon == DELIM_NONE) {
+            scan->colon = i;
+        }
+    }
+    return len;
+}
+
+/* static int valid_scalar(const char* s)
+* -----------------------------------------------
+* Byte at a time version of is_valid_string()
+*/
+static int valid_scalar(const char* s) {
+    for (; *s; s++) {
+        if (*s == ' ' || *s == ':' || *s == '\n') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#ifdef DELIM_X86
+/* static size_t scan_sse2(const char* buf, size_t start, size_t len,
+*         DelimScan* scan)
+* -----------------------------------------------
+* SSE2 version of delim_scan(), comparing 16 bytes against all three
+* delimiters per step
+*/
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char* buf, size_t start, size_t len,
+        DelimScan* scan) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i colon = _mm_set1_epi8(':');
+    size_t i = start;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+        __m128i isNewline = _mm_cmpeq_epi8(v, newline);
+        __m128i isSpace = _mm_cmpeq_epi8(v, space);
+        __m128i isColon = _mm_cmpeq_epi8(v, colon);
+        if (!_mm_movemask_epi8(_mm_or_si128(isNewline,
+                _mm_or_si128(isSpace, isColon)))) {
+            continue; // Common case: no delimiters in this block
+        }
+        uint32_t newlines = _mm_movemask_epi8(isNewline);
+        uint32_t spaces = _mm_movemask_epi8(isSpace);
+        uint32_t colons = _mm_movemask_epi8(isColon);
+        if (newlines) {
+            int end = __builtin_ctz(newlines);
+            uint32_t before = (1U << end) - 1;
+            note_masks(scan, i, spaces & before, colons & before);
+            return i + end;
+        }
+        note_masks(scan, i, spaces, colons);
+    }
+    return scan_scalar(buf, i, len, scan);
+}
+
+/* static size_t scan_avx2(const char* buf, size_t start, size_t len,
+*         DelimScan* scan)
+* -----------------------------------------------
+* AVX2 version of delim_scan(), comparing 32 bytes against all three
+* delimiters per step
+*/
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char* buf, size_t start, size_t len,
+        DelimScan* scan) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i colon = _mm256_set1_epi8(':');
+    size_t i = start;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        __m256i isNewline = _mm256_cmpeq_epi8(v, newline);
+        __m256i isSpace = _mm256_cmpeq_epi8(v, space);
+        __m256i isColon = _mm256_cmpeq_epi8(v, colon);
+        if (!_mm256_movemask_epi8(_mm256_or_si256(isNewline,
+                _mm256_or_si256(isSpace, isColon)))) {
+            continue; // Common case: no delimiters in this block
+        }
+        uint32_t newlines = _mm256_movemask_epi8(isNewline);
+        uint32_t spaces = _mm256_movemask_epi8(isSpace);
+        uint32_t colons = _mm256_movemask_epi8(isColon);
+        if (newlines) {
+            int end = __builtin_ctz(newlines);
+            uint32_t before = (end == 0) ? 0 : (0xFFFFFFFFU >> (32 - end));
+            note_masks(scan, i, spaces & before, colons & before);
+            _mm256_zeroupper();
+            return i + end;
+        }
+        note_masks(scan, i, spaces, colons);
+    }
+    // Clear the upper halves of the vector registers so the SSE code that
+    // follows doesn't pay the AVX to SSE transition penalty
+    _mm256_zeroupper();
+    return scan_sse2(buf, i, len, scan);
+}
+/* static int valid_sse2(const char* s)
+* -----------------------------------------------
+* SSE2 version of is_valid_string(). Loads are aligned to 16 bytes, so the
+* bytes read past the NUL are in the same page as it and can't fault.
+*/
+__attribute__((target("sse2")))
+static int valid_sse2(const char* s) {
+    const __m128i nul = _mm_setzero_si128();
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i colon = _mm_set1_epi8(':');
+    size_t skip = (uintptr_t) s & 15;
+    const char* p = s - skip;
+    // Bytes before s in the first block are ignored
+    uint32_t ignore = (1U << skip) - 1;
+    for (;; p += 16) {
+        __m128i v = _mm_load_si128((const __m128i *) p);
+        uint32_t ends = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nul)) & ~ignore;
+        uint32_t bad = _mm_movemask_epi8(_mm_or_si128(
+                _mm_cmpeq_epi8(v, newline), _mm_or_si128(
+                _mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, colon))))
+                & ~ignore;
+        ignore = 0;
+        if (ends | bad) {
+            // Valid if the NUL comes before any delimiter
+            return ends && (!bad || __builtin_ctz(ends) < __builtin_ctz(bad));
+        }
+    }
+}
+
+/* static int valid_avx2(const char* s)
+* -----------------------------------------------
+* AVX2 version of is_valid_string(). Loads are aligned to 32 bytes, so the
+* bytes read past the NUL are in the same page as it and can't fault.
+*/
+__attribute__((target("avx2")))
+static int valid_avx2(const char* s) {
+    const __m256i nul = _mm256_setzero_si256();
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i colon = _mm256_set1_epi8(':');
+    size_t skip = (uintptr_t) s & 31;
+    const char* p = s - skip;
+    // Bytes before s in the first block are ignored
+    uint32_t ignore = (skip == 0) ? 0 : (0xFFFFFFFFU >> (32 - skip));
+    for (;; p += 32) {
+        __m256i v = _mm256_load_si256((const __m256i *) p);
+        uint32_t ends = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nul))
+                & ~ignore;
+        uint32_t bad = _mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_cmpeq_epi8(v, newline), _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, colon))))
+                & ~ignore;
+        ignore = 0;
+        if (ends | bad) {
+            _mm256_zeroupper();
+            // Valid if the NUL comes before any delimiter
+            return ends && (!bad || __builtin_ctz(ends) < __builtin_ctz(bad));
+        }
+    }
+}
+#endif
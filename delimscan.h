@@ -0,0 +1,31 @@
+// delimscan.h
+// Author: Rohith Kotia Palakirti
+
+#ifndef DELIMSCAN_H
+#define DELIMSCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Position recorded in a DelimScan for a delimiter that has not been seen
+#define DELIM_NONE SIZE_MAX
+
+/* DelimScan Struct
+* -----------------------------------------------
+* Structure to hold the delimiters found in a line by delim_scan()
+* space: positions of the first two spaces, DELIM_NONE if not present
+* colon: position of the first colon, DELIM_NONE if not present
+*/
+typedef struct DelimScan {
+    size_t space[2];
+    size_t colon;
+} DelimScan;
+
+/*
+ * Function Prototypes
+ */
+void delim_scan_init(DelimScan* scan);
+size_t delim_scan(const char* buf, size_t start, size_t len, DelimScan* scan);
+int is_valid_string(char* s);
+
+#endif
@@ -0,0 +1,170 @@
+// fanbench.c
+// Author: Rohith Kotia Palakirti
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include "fanout.h"
+
+// Size of the blocks the drain thread reads
+#define DRAIN_BLOCK 65536
+// Most sockets reported by one epoll_wait()
+#define MAX_EVENTS 64
+
+/*
+* Struct Definitions
+*/
+
+/* Drain Struct
+* -----------------------------------------------
+* Structure to hold the subscriber ends of the sockets, which are read by
+* the drain thread so the sends never block for long
+* epollFd: epoll instance watching every subscriber end
+* expected: bytes the subscribers are due to receive in the current run
+* received: bytes received so far in the current run
+*/
+typedef struct Drain {
+    int epollFd;
+    uint64_t expected;
+    uint64_t received;
+} Drain;
+
+/*
+ * Function Prototypes
+ */
+void* drain_thread(void* arg);
+void run(const char* label, int useUring, int* fds, int count, int messages,
+        size_t size, Drain* drain);
+uint64_t now_ns(void);
+
+/* int main(int argc, char *argv[])
+* -----------------------------------------------
+* Measures the fan-out of one message to many sockets with one send() per
+* socket and with the io_uring backend, reporting the system calls made
+* and the time taken by each
+*
+* argc: count of number of commandline arguments
+* argv: the array of commandline arguments stored as strings
+*
+* Usage: fanbench [subscribers [messages [size]]]
+*   subscribers  sockets each message is sent to (default 200)
+*   messages     messages sent (default 2000)
+*   size         bytes in each message (default 64)
+*
+* Returns: 0 on success, 1 if the input is invalid
+*/
+int main(int argc, char* argv[]) {
+    int count = (argc > 1) ? atoi(argv[1]) : 200;
+    int messages = (argc > 2) ? atoi(argv[2]) : 2000;
+    long size = (argc > 3) ? atol(argv[3]) : 64;
+    if (argc > 4 || count <= 0 || messages <= 0 || size <= 0) {
+        fprintf(stderr, "Usage: fanbench [subscribers [messages [size]]]\n");
+        return 1;
+    }
+    Drain drain = {.epollFd = epoll_create1(0)};
+    int* fds = malloc(sizeof(int) * count);
+    for (int i = 0; i < count; i++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) {
+            perror("socketpair");
+            return 1;
+        }
+        fds[i] = pair[0];
+        struct epoll_event ev = {.events = EPOLLIN, .data.fd = pair[1]};
+        epoll_ctl(drain.epollFd, EPOLL_CTL_ADD, pair[1], &ev);
+    }
+    pthread_t threadId;
+    pthread_create(&threadId, NULL, drain_thread, &drain);
+    pthread_detach(threadId);
+    run("sync", 0, fds, count, messages, size, &drain);
+    run("uring", 1, fds, count, messages, size, &drain);
+    return 0;
+}
+
+/* void run(const char* label, int useUring, int* fds, int count,
+*         int messages, size_t size, Drain* drain)
+* -----------------------------------------------
+* Sends every message to every socket with one backend and prints the
+* results
+*
+* label: name of the backend, printed with the results
+* useUring: passed to fanout_init()
+* fds: the sockets to send to
+* count: number of sockets
+* messages: number of messages to send
+* size: bytes in each message
+* drain: the drain thread's state, used to wait for every byte to arrive
+*/
+void run(const char* label, int useUring, int* fds, int count, int messages,
+        size_t size, Drain* drain) {
+    FanoutRing ring;
+    fanout_init(&ring, useUring);
+    if (useUring && ring.ringFd < 0) {
+        printf("%-5s  io_uring is not available\n", label);
+        return;
+    }
+    char* buf = malloc(size);
+    memset(buf, 'x', size);
+    buf[size - 1] = '\n';
+    __atomic_store_n(&drain->received, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&drain->expected, (uint64_t) size * count * messages,
+            __ATOMIC_RELAXED);
+    uint64_t start = now_ns();
+    for (int i = 0; i < messages; i++) {
+        fanout_send(&ring, fds, count, buf, size);
+    }
+    while (__atomic_load_n(&drain->received, __ATOMIC_RELAXED)
+            < drain->expected) {
+        sched_yield();
+    }
+    double secs = (now_ns() - start) / 1e9;
+    printf("%-5s  %lu sends, %lu syscalls (%.3f per send), %.3fs, "
+            "%.0f sends/s\n", label, ring.messages, ring.syscalls,
+            (double) ring.syscalls / ring.messages, secs,
+            ring.messages / secs);
+    free(buf);
+    fanout_free(&ring);
+}
+
+/* void* drain_thread(void* arg)
+* -----------------------------------------------
+* Thread function that reads and discards everything sent to the
+* subscriber ends of the sockets
+*
+* arg: the Drain
+*
+* Returns: NULL (never returns)
+*/
+void* drain_thread(void* arg) {
+    Drain* drain = arg;
+    struct epoll_event events[MAX_EVENTS];
+    char* buf = malloc(DRAIN_BLOCK);
+    while (1) {
+        int n = epoll_wait(drain->epollFd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            ssize_t got = read(events[i].data.fd, buf, DRAIN_BLOCK);
+            if (got > 0) {
+                __atomic_add_fetch(&drain->received, got, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* uint64_t now_ns(void)
+* -----------------------------------------------
+* Returns: the current monotonic time in nanoseconds
+*/
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,312 @@
+// fanout.c
+// Author: Rohith Kotia Palakirti
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include "fanout.h"
+
+/*
+ * Function Prototypes
+ */
+static int fanout_setup(FanoutRing* ring);
+static int fanout_probe_zc(FanoutRing* ring);
+static int fanout_batch(FanoutRing* ring, const int* fds, int count,
+        const char* buf, size_t len);
+static void send_all(FanoutRing* ring, int fd, const char* buf, size_t len);
+
+/* void fanout_init(FanoutRing* ring, int useUring)
+* -----------------------------------------------
+* Initializes a FanoutRing, setting up an io_uring if requested and
+* supported by the kernel
+*
+* ring: the FanoutRing to be initialized
+* useUring: 0 to always use one send() per socket
+*/
+void fanout_init(FanoutRing* ring, int useUring) {
+    memset(ring, 0, sizeof(FanoutRing));
+    ring->ringFd = -1;
+    if (useUring && !fanout_setup(ring)) {
+        fanout_free(ring);
+        ring->ringFd = -1;
+    }
+}
+
+/* static int fanout_setup(FanoutRing* ring)
+* -----------------------------------------------
+* Creates the io_uring and maps its queues
+*
+* ring: the FanoutRing to set up
+*
+* Returns: 1 on success, 0 if io_uring is unavailable
+*/
+static int fanout_setup(FanoutRing* ring) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->ringFd = syscall(__NR_io_uring_setup, FANOUT_DEPTH, &p);
+    if (ring->ringFd < 0) {
+        return 0;
+    }
+    ring->sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cqMapSize = p.cq_off.cqes
+            + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqMapSize > ring->sqMapSize) {
+            ring->sqMapSize = ring->cqMapSize;
+        }
+        ring->cqMapSize = 0;
+    }
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->ringFd, IORING_OFF_SQ_RING);
+    if (ring->sqMap == MAP_FAILED) {
+        ring->sqMap = NULL;
+        return 0;
+    }
+    ring->cqMap = ring->sqMap;
+    if (ring->cqMapSize) {
+        ring->cqMap = mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->ringFd, IORING_OFF_CQ_RING);
+        if (ring->cqMap == MAP_FAILED) {
+            ring->cqMap = NULL;
+            return 0;
+        }
+    }
+    ring->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->ringFd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return 0;
+    }
+    char* sq = ring->sqMap;
+    char* cq = ring->cqMap;
+    ring->sqHead = (unsigned *) (sq + p.sq_off.head);
+    ring->sqTail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sqMask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) (sq + p.sq_off.array);
+    ring->cqHead = (unsigned *) (cq + p.cq_off.head);
+    ring->cqTail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cqMask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    ring->zeroCopy = fanout_probe_zc(ring);
+    return 1;
+}
+
+/* static int fanout_probe_zc(FanoutRing* ring)
+* -----------------------------------------------
+* Asks the kernel whether it supports zero-copy sends
+*
+* ring: the FanoutRing to check
+*
+* Returns: 1 if IORING_OP_SEND_ZC is supported, 0 otherwise
+*/
+static int fanout_probe_zc(FanoutRing* ring) {
+#ifdef IORING_CQE_F_NOTIF
+    size_t size = sizeof(struct io_uring_probe)
+            + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    int supported = 0;
+    if (syscall(__NR_io_uring_register, ring->ringFd, IORING_REGISTER_PROBE,
+            probe, 256) == 0 && probe->last_op >= IORING_OP_SEND_ZC) {
+        supported = (probe->ops[IORING_OP_SEND_ZC].flags
+                & IO_URING_OP_SUPPORTED) != 0;
+    }
+    free(probe);
+    return supported;
+#else
+    return 0;
+#endif
+}
+
+/* void fanout_send(FanoutRing* ring, const int* fds, int count,
+*         const char* buf, size_t len)
+* -----------------------------------------------
+* Sends the whole of buf to each socket. With io_uring, up to FANOUT_DEPTH
+* sends are submitted and reaped with one system call, using zero-copy for
+* large buffers. Sockets that error (e.g. because the peer has gone) are
+* skipped, and sockets that time out (see SO_SNDTIMEO) part way through buf
+* are shut down, since the peer would otherwise get a torn message. Does not
+* return until every send has completed, so buf may be freed afterwards.
+*
+* ring: the FanoutRing to send with
+* fds: the sockets to send to
+* count: number of sockets
+* buf: the data to send
+* len: length of buf in bytes
+*/
+void fanout_send(FanoutRing* ring, const int* fds, int count,
+        const char* buf, size_t len) {
+    int sent = 0;
+    ring->messages += count;
+    if (ring->ringFd >= 0) {
+        while (sent < count) {
+            int n = count - sent;
+            n = (n < FANOUT_DEPTH) ? n : FANOUT_DEPTH;
+            if (!fanout_batch(ring, fds + sent, n, buf, len)) {
+                break;
+            }
+            sent += n;
+        }
+    }
+    for (int i = sent; i < count; i++) {
+        send_all(ring, fds[i], buf, len);
+    }
+}
+
+/* static int fanout_batch(FanoutRing* ring, const int* fds, int count,
+*         const char* buf, size_t len)
+* -----------------------------------------------
+* Submits one send per socket and waits for all of them to complete, even
+* if a later submission fails. The sends don't wait for a full socket, so
+* sockets that only took part of buf, had no room for it, or whose send
+* could not be submitted, are finished off with send(), which honours the
+* socket's send timeout.
+*
+* ring: the FanoutRing to send with
+* fds: the sockets to send to (at most FANOUT_DEPTH)
+* count: number of sockets
+* buf: the data to send
+* len: length of buf in bytes
+*
+* Returns: 1 on success, 0 if nothing could be submitted
+*/
+static int fanout_batch(FanoutRing* ring, const int* fds, int count,
+        const char* buf, size_t len) {
+    int zeroCopy = ring->zeroCopy && len >= FANOUT_ZC_MIN;
+    unsigned tail = *ring->sqTail;
+    for (int i = 0; i < count; i++) {
+        unsigned index = tail & *ring->sqMask;
+        struct io_uring_sqe* sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_SEND;
+#ifdef IORING_CQE_F_NOTIF
+        if (zeroCopy) {
+            sqe->opcode = IORING_OP_SEND_ZC;
+        }
+#endif
+        sqe->fd = fds[i];
+        sqe->addr = (uintptr_t) buf;
+        sqe->len = len;
+        // io_uring would otherwise wait for room with no timeout
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+        sqe->user_data = i;
+        ring->sqArray[index] = index;
+        tail++;
+    }
+    __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+    // Sends that are never submitted are left at 0 bytes sent, so they are
+    // made with send() below
+    ssize_t results[FANOUT_DEPTH] = {0};
+    // Completions still expected, including the buffer release notifications
+    // that follow zero-copy sends
+    int pending = count;
+    int unsubmitted = count;
+    while (pending > 0) {
+        int ret = syscall(__NR_io_uring_enter, ring->ringFd, unsubmitted,
+                pending, IORING_ENTER_GETEVENTS, NULL, 0);
+        ring->syscalls++;
+        if (ret < 0 && errno != EINTR && unsubmitted > 0) {
+            // Take back the entries the kernel hasn't consumed so they are
+            // not sent later from a freed buffer, but keep waiting for the
+            // sends already in flight, which still use buf
+            __atomic_store_n(ring->sqTail, tail - unsubmitted,
+                    __ATOMIC_RELEASE);
+            pending -= unsubmitted;
+            if (unsubmitted == count) {
+                return 0;
+            }
+            unsubmitted = 0;
+            continue;
+        }
+        if (ret > 0) {
+            unsubmitted -= ret;
+        }
+        unsigned head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+            pending--;
+#ifdef IORING_CQE_F_NOTIF
+            if (cqe->flags & IORING_CQE_F_MORE) {
+                pending++; // Notification to follow
+            }
+            if (!(cqe->flags & IORING_CQE_F_NOTIF)) {
+                results[cqe->user_data] = cqe->res;
+            }
+#else
+            results[cqe->user_data] = cqe->res;
+#endif
+            head++;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+    for (int i = 0; i < count; i++) {
+        if (results[i] >= 0 && (size_t) results[i] < len) {
+            send_all(ring, fds[i], buf + results[i], len - results[i]);
+        } else if (results[i] == -EAGAIN || results[i] == -EOPNOTSUPP
+                || results[i] == -EINVAL) {
+            // No room yet, or zero-copy is not supported on every socket type
+            send_all(ring, fds[i], buf, len);
+        }
+    }
+    return 1;
+}
+
+/* static void send_all(FanoutRing* ring, int fd, const char* buf,
+*         size_t len)
+* -----------------------------------------------
+* Sends the whole of buf to a socket with send(), giving up on error. A
+* socket whose send timeout expires is shut down.
+*
+* ring: the FanoutRing whose statistics are updated
+* fd: the socket to send to
+* buf: the data to send
+* len: length of buf in bytes
+*/
+static void send_all(FanoutRing* ring, int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = send(fd, buf, len, MSG_NOSIGNAL);
+        ring->syscalls++;
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                shutdown(fd, SHUT_RDWR);
+            }
+            return;
+        }
+        buf += written;
+        len -= written;
+    }
+}
+
+/* void fanout_free(FanoutRing* ring)
+* -----------------------------------------------
+* Releases the io_uring held by a FanoutRing, if any
+*
+* ring: the FanoutRing to be freed
+*/
+void fanout_free(FanoutRing* ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqMap && ring->cqMap != ring->sqMap) {
+        munmap(ring->cqMap, ring->cqMapSize);
+    }
+    if (ring->sqMap) {
+        munmap(ring->sqMap, ring->sqMapSize);
+    }
+    if (ring->ringFd >= 0) {
+        close(ring->ringFd);
+    }
+    memset(ring, 0, sizeof(FanoutRing));
+    ring->ringFd = -1;
+}
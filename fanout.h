@@ -0,0 +1,58 @@
+// fanout.h
+// Author: Rohith Kotia Palakirti
+
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stddef.h>
+
+// Number of sends submitted to the kernel in one io_uring_enter() call
+#define FANOUT_DEPTH 256
+// Smallest message buffer worth sending with zero-copy
+#define FANOUT_ZC_MIN 16384
+
+/* FanoutRing Struct
+* -----------------------------------------------
+* Structure to hold an io_uring used to send one buffer to many sockets with
+* a single system call. If io_uring is not available, ringFd is -1 and
+* sends fall back to one send() per socket.
+* ringFd: the io_uring file descriptor, or -1
+* zeroCopy: flag to indicate the kernel supports zero-copy sends
+* sqHead, sqTail, sqMask, sqArray: the mapped submission queue
+* sqes: the mapped submission queue entries
+* cqHead, cqTail, cqMask, cqes: the mapped completion queue
+* sqMap, sqMapSize, cqMap, cqMapSize, sqesSize: mappings to release
+* messages: number of sends performed
+* syscalls: number of system calls used to perform them (both are reported
+*           by psserver on SIGHUP and by fanbench)
+*/
+typedef struct FanoutRing {
+    int ringFd;
+    int zeroCopy;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqMap;
+    size_t sqMapSize;
+    void* cqMap;
+    size_t cqMapSize;
+    size_t sqesSize;
+    unsigned long messages;
+    unsigned long syscalls;
+} FanoutRing;
+
+/*
+ * Function Prototypes
+ */
+void fanout_init(FanoutRing* ring, int useUring);
+void fanout_send(FanoutRing* ring, const int* fds, int count,
+        const char* buf, size_t len);
+void fanout_free(FanoutRing* ring);
+
+#endif
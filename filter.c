@@ -0,0 +1,160 @@
+// filter.c
+// Author: Rohith Kotia Palakirti
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "filter.h"
+
+/*
+ * Function Prototypes
+ */
+static const char* filter_search(const Filter* filter, const char* payload,
+        const char* end);
+static bool is_field_break(char c);
+
+/* int filter_compile(Filter* filter, const char* expr)
+* -----------------------------------------------
+* Compiles a filter expression, which is one of
+*   prefix <text>         the payload starts with text
+*   contains <text>       the payload contains text
+*   field <key>=<value>   a field of the payload is key=value
+* text may contain spaces. Searches use a skip table built here, so no
+* work is repeated when the filter is run.
+*
+* filter: populated with the compiled filter
+* expr: the expression
+*
+* Returns: 1 on success, 0 if the expression is invalid
+*/
+int filter_compile(Filter* filter, const char* expr) {
+    const char* text;
+    if (strncmp(expr, "prefix ", 7) == 0) {
+        filter->kind = FILTER_PREFIX;
+        text = expr + 7;
+    } else if (strncmp(expr, "contains ", 9) == 0) {
+        filter->kind = FILTER_CONTAINS;
+        text = expr + 9;
+    } else if (strncmp(expr, "field ", 6) == 0) {
+        filter->kind = FILTER_FIELD;
+        text = expr + 6;
+        // The key can't be empty and neither can contain a field break
+        const char* equals = strchr(text, '=');
+        if (!equals || equals == text || strpbrk(text, " ,")) {
+            return 0;
+        }
+    } else {
+        return 0;
+    }
+    filter->len = strlen(text);
+    if (filter->len == 0) {
+        return 0;
+    }
+    filter->text = strdup(text);
+    for (int i = 0; i < 256; i++) {
+        filter->skip[i] = filter->len;
+    }
+    for (size_t i = 0; i + 1 < filter->len; i++) {
+        filter->skip[(unsigned char) text[i]] = filter->len - 1 - i;
+    }
+    return 1;
+}
+
+/* int filter_match(const Filter* filter, const char* payload, size_t len)
+* -----------------------------------------------
+* Runs a compiled filter on a message payload
+*
+* filter: the filter
+* payload: the payload
+* len: length of payload in bytes
+*
+* Returns: 1 if the payload matches, 0 otherwise
+*/
+int filter_match(const Filter* filter, const char* payload, size_t len) {
+    if (len < filter->len) {
+        return 0;
+    }
+    const char* end = payload + len;
+    const char* found;
+    switch (filter->kind) {
+        case FILTER_PREFIX:
+            return memcmp(payload, filter->text, filter->len) == 0;
+        case FILTER_CONTAINS:
+            return filter_search(filter, payload, end) != NULL;
+        case FILTER_FIELD:
+            while ((found = filter_search(filter, payload, end))) {
+                const char* after = found + filter->len;
+                if ((found == payload || is_field_break(found[-1]))
+                        && (after == end || is_field_break(*after))) {
+                    return 1;
+                }
+                payload = found + 1;
+            }
+            return 0;
+    }
+    return 0;
+}
+
+/* int filter_equal(const Filter* a, const Filter* b)
+* -----------------------------------------------
+* Checks whether two filters always give the same result
+*
+* a, b: the filters to compare
+*
+* Returns: 1 if they are the same, 0 otherwise
+*/
+int filter_equal(const Filter* a, const Filter* b) {
+    return a->kind == b->kind && a->len == b->len
+            && memcmp(a->text, b->text, a->len) == 0;
+}
+
+/* void filter_free(Filter* filter)
+* -----------------------------------------------
+* Frees memory allocated by filter_compile()
+*
+* filter: the filter to be freed
+*/
+void filter_free(Filter* filter) {
+    free(filter->text);
+    filter->text = NULL;
+}
+
+/* static const char* filter_search(const Filter* filter,
+*         const char* payload, const char* end)
+* -----------------------------------------------
+* Finds the first occurrence of the filter's text in a payload, comparing
+* the last character of the text first and skipping ahead by the skip table
+* on a mismatch (Boyer-Moore-Horspool)
+*
+* filter: the filter
+* payload: start of the bytes to search
+* end: end of the bytes to search
+*
+* Returns: the start of the occurrence, or NULL if there is none
+*/
+static const char* filter_search(const Filter* filter, const char* payload,
+        const char* end) {
+    size_t last = filter->len - 1;
+    while ((size_t) (end - payload) >= filter->len) {
+        char c = payload[last];
+        if (c == filter->text[last]
+                && memcmp(payload, filter->text, last) == 0) {
+            return payload;
+        }
+        payload += filter->skip[(unsigned char) c];
+    }
+    return NULL;
+}
+
+/* static bool is_field_break(char c)
+* -----------------------------------------------
+* Checks whether a character separates the fields of a payload
+*
+* c: the character
+*
+* Returns: true if c is a space or comma
+*/
+static bool is_field_break(char c) {
+    return c == ' ' || c == ',';
+}
@@ -0,0 +1,49 @@
+// filter.h
+// Author: Rohith Kotia Palakirti
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* FilterKind Enum
+* -----------------------------------------------
+* The predicates a subscription filter can apply to a message payload
+* FILTER_PREFIX: the payload starts with the text
+* FILTER_CONTAINS: the payload contains the text
+* FILTER_FIELD: one of the payload's space or comma separated fields is
+*               exactly the text (which is "key=value")
+*/
+typedef enum FilterKind {
+    FILTER_PREFIX,
+    FILTER_CONTAINS,
+    FILTER_FIELD
+} FilterKind;
+
+/* Filter Struct
+* -----------------------------------------------
+* A compiled subscription filter
+* kind: the predicate
+* text: the text the predicate looks for
+* len: length of text
+* skip: for each byte value, how far the text can be moved along when the
+*       payload byte under its last character has that value (used to
+*       search for text in FILTER_CONTAINS and FILTER_FIELD)
+*/
+typedef struct Filter {
+    FilterKind kind;
+    char* text;
+    size_t len;
+    uint32_t skip[256];
+} Filter;
+
+/*
+ * Function Prototypes
+ */
+int filter_compile(Filter* filter, const char* expr);
+int filter_match(const Filter* filter, const char* payload, size_t len);
+int filter_equal(const Filter* a, const Filter* b);
+void filter_free(Filter* filter);
+
+#endif
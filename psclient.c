@@ -3,6 +3,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -14,15 +15,80 @@
 #include <pthread.h>
 #include <stringmap.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <csse2310a3.h>
 #include <csse2310a4.h>
 #include <semaphore.h>
+#include <stdint.h>
+#include <time.h>
+#include "shmring.h"
+#include "delimscan.h"
+
+// Size of the blocks read and written in --batch mode
+#define BATCH_BLOCK 65536
+// Line sent by the server to check the client is still there, and the
+// reply that shows it is
+#define HEARTBEAT_LINE ":heartbeat"
+#define HEARTBEAT HEARTBEAT_LINE "\n"
+#define HEARTBEAT_REPLY "heartbeat\n"
+
+/*
+* Struct Definitions
+*/
+
+/* BatchStats Struct
+* -----------------------------------------------
+* Structure to hold the message counts reported on exit in --batch mode
+* startNs: time (ns, CLOCK_MONOTONIC) at which the client connected
+* sent: lines sent to the server (updated by the stdin thread)
+* received: lines received from the server (updated by the main thread)
+*/
+typedef struct BatchStats {
+    uint64_t startNs;
+    unsigned long sent;
+    unsigned long received;
+} BatchStats;
+
+/* StdinArgs Struct
+* -----------------------------------------------
+* Structure to hold the arguments that are passed to the stdin thread
+* to: stream to the server
+* stats: message counts, NULL unless in --batch mode
+*/
+typedef struct StdinArgs {
+    FILE* to;
+    BatchStats* stats;
+} StdinArgs;
+
+/* HeartbeatFilter Struct
+* -----------------------------------------------
+* Structure to hold what strip_heartbeats() needs to remember between
+* blocks received in --batch mode
+* held: bytes at the end of the last block held back because they may be
+*       the start of a heartbeat
+* midLine: flag to indicate the last block ended part way through a line
+*          that can't be a heartbeat
+*/
+typedef struct HeartbeatFilter {
+    size_t held;
+    bool midLine;
+} HeartbeatFilter;
 
 /*
  * Function Prototypes
  */
 void* stdin_thread(void* arg);
-int is_valid_string(char* s);
+int connect_server(const char* portNum);
+char** read_topic_file(const char* path, int* count);
+void subscribe(FILE* to, char* name, char** topics, int count, bool batch);
+void batch_stdin(FILE* to, BatchStats* stats);
+void batch_receive(int fd, ShmLink* link, FILE* to, BatchStats* stats);
+size_t strip_heartbeats(char* buf, size_t len, HeartbeatFilter* filter,
+        int* beats);
+void send_heartbeat_reply(FILE* to);
+unsigned long count_lines(const char* buf, size_t len);
+void report_rate(BatchStats* stats);
+uint64_t now_ns(void);
 
 /* int main(int argc, char *argv[])
 * -----------------------------------------------
@@ -31,6 +97,18 @@ int is_valid_string(char* s);
 * argc: count of number of commandline arguments
 * argv: the array of commandline arguments stored as strings
 *
+* portnum may also be the path of the server's unix domain socket (any
+* argument containing a '/').
+*
+* Options (must come before portnum):
+*   --shm             move a unix domain socket connection onto a shared
+*                     memory link once it is established
+*   --batch           read and write stdin, stdout and the server in large
+*                     blocks rather than line by line, and report the
+*                     message rates on exit
+*   --topicfile path  also subscribe to each topic listed (one per line)
+*                     in path
+*
 * Returns: exit code of the program
 * Errors: program exits with code 1 if the input is invalid
 *                            code 2 is topic or name is invalid
@@ -38,26 +116,118 @@ int is_valid_string(char* s);
 *                            code 4 if server is terminated
 */
 int main(int argc, char* argv[]) {
+    bool useShm = false;
+    bool batch = false;
+    char* topicFile = NULL;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--shm") == 0) {
+            useShm = true;
+        } else if (strcmp(argv[1], "--batch") == 0) {
+            batch = true;
+        } else if (strcmp(argv[1], "--topicfile") == 0 && argc > 2) {
+            topicFile = argv[2];
+            argc--;
+            argv++;
+        } else {
+            fprintf(stderr, "Usage: psclient portnum name [topic] ...\n");
+            exit(1);
+        }
+        argc--;
+        argv++;
+    }
     if (argc < 3) {
         fprintf(stderr, "Usage: psclient portnum name [topic] ...\n");
         exit(1);
     }
     const char* portNum = argv[1];
     char* name = argv[2];
-    char* topics[argc - 3];
+    int topicCount = argc - 3;
+    char** topics = topicFile ? read_topic_file(topicFile, &topicCount)
+            : malloc(sizeof(char*) * topicCount);
     for (int i = 3; i < argc; i++) {
-        topics[i - 3] = argv[i];
+        topics[topicCount - (argc - i)] = argv[i];
     }
     if (!is_valid_string(name)) {
         fprintf(stderr, "psclient: invalid name\n");
         exit(2);
     }
-    for (int i = 0; i < argc - 3; i++) {
+    for (int i = 0; i < topicCount; i++) {
         if (!(is_valid_string(topics[i])) && strlen(topics[i]) != 0) {
             fprintf(stderr, "psclient: invalid topic\n");
             exit(2);
         }
     }
+    int fd = connect_server(portNum);
+    FILE* to;
+    FILE* from;
+    ShmLink* link = NULL;
+    if (useShm) {
+        if (strchr(portNum, '/') && write(fd, "shm\n", 4) == 4) {
+            link = shm_link_accept(fd);
+        }
+        if (!link) {
+            fprintf(stderr, "psclient: unable to connect to port %s\n",
+                    portNum);
+            exit(3);
+        }
+        to = shm_link_fopen(link, "w");
+        from = shm_link_fopen(link, "r");
+    } else {
+        int fd2 = dup(fd);
+        to = fdopen(fd, "w");
+        from = fdopen(fd2, "r");
+    }
+    BatchStats stats = {.startNs = now_ns(), .sent = 0, .received = 0};
+    StdinArgs args = {.to = to, .stats = batch ? &stats : NULL};
+    subscribe(to, name, topics, topicCount, batch);
+    pthread_t threadId;
+    pthread_create(&threadId, NULL, stdin_thread, &args);
+    pthread_detach(threadId);
+    if (batch) {
+        batch_receive(fileno(from), link, to, &stats);
+        fprintf(stderr, "psclient: server connection terminated\n");
+        report_rate(&stats);
+        exit(4);
+    }
+    char* readLine;
+    while ((readLine = read_line(from))) {
+        if (strcmp(readLine, HEARTBEAT_LINE) == 0) {
+            send_heartbeat_reply(to);
+            continue;
+        }
+        printf("%s\n", readLine);
+        fflush(stdout);
+    }
+    fprintf(stderr, "psclient: server connection terminated\n");
+    free(readLine);
+    exit(4);
+}
+
+/* int connect_server(const char* portNum)
+* -----------------------------------------------
+* Connects to the server over TCP on localhost, or over a unix domain socket
+* if portNum is a path
+*
+* portNum: port number or socket path of the server
+*
+* Returns: the connected socket
+* Errors: program exits with code 3 if the connection fails
+*/
+int connect_server(const char* portNum) {
+    if (strchr(portNum, '/')) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(struct sockaddr_un));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, portNum, sizeof(addr.sun_path) - 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (strlen(portNum) >= sizeof(addr.sun_path) || connect(fd,
+                (struct sockaddr *)&addr, sizeof(struct sockaddr_un))) {
+            fprintf(stderr, "psclient: unable to connect to port %s\n",
+                    portNum);
+            exit(3);
+        }
+        return fd;
+    }
     struct addrinfo* ai = 0;
     struct addrinfo hints;
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -74,26 +244,78 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "psclient: unable to connect to port %s\n", portNum);
         exit(3);
     }
-    int fd2 = dup(fd);
-    FILE* to = fdopen(fd, "w");
-    FILE* from = fdopen(fd2, "r");
+    freeaddrinfo(ai);
+    return fd;
+}
+
+/* char** read_topic_file(const char* path, int* count)
+* -----------------------------------------------
+* Reads the topics listed in a file, one per line, ignoring empty lines.
+* Room is left at the end of the returned array for count further topics.
+*
+* path: the file to be read
+* count: number of extra entries to allow for, updated to the total
+*
+* Returns: the topics read
+* Errors: program exits with code 2 if the file can't be read
+*/
+char** read_topic_file(const char* path, int* count) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "psclient: invalid topic\n");
+        exit(2);
+    }
+    int size = 16;
+    int read = 0;
+    char** topics = malloc(sizeof(char*) * size);
+    char* line;
+    while ((line = read_line(f))) {
+        if (strlen(line) == 0) {
+            free(line);
+            continue;
+        }
+        if (read == size) {
+            size *= 2;
+            topics = realloc(topics, sizeof(char*) * size);
+        }
+        topics[read++] = line;
+    }
+    fclose(f);
+    topics = realloc(topics, sizeof(char*) * (read + *count + 1));
+    *count += read;
+    return topics;
+}
+
+/* void subscribe(FILE* to, char* name, char** topics, int count, bool batch)
+* -----------------------------------------------
+* Sends the client's name and subscriptions to the server. In batch mode
+* they are all sent in a single write.
+*
+* to: stream to the server
+* name: name of the client
+* topics: topics to subscribe to
+* count: number of topics
+* batch: true to send everything at once
+*/
+void subscribe(FILE* to, char* name, char** topics, int count, bool batch) {
+    if (batch) {
+        size_t len = strlen(name) + 6;
+        for (int i = 0; i < count; i++) {
+            len += strlen(topics[i]) + 5;
+        }
+        setvbuf(to, NULL, _IOFBF, len > BATCH_BLOCK ? len : BATCH_BLOCK);
+    }
     fprintf(to, "name %s\n", name);
-    fflush(to);
-    for (int i = 0; i < argc - 3; i++) {
-        fprintf(to, "sub %s\n", topics[i]);
+    if (!batch) {
         fflush(to);
     }
-    pthread_t threadId;
-    pthread_create(&threadId, NULL, stdin_thread, to);
-    pthread_detach(threadId);
-    char* readLine;
-    while ((readLine = read_line(from))) {
-        printf("%s\n", readLine);
-        fflush(stdout);
+    for (int i = 0; i < count; i++) {
+        fprintf(to, "sub %s\n", topics[i]);
+        if (!batch) {
+            fflush(to);
+        }
     }
-    fprintf(stderr, "psclient: server connection terminated\n");
-    free(readLine);
-    exit(4);
+    fflush(to);
 }
 
 /* void* stdin_thread(void* arg)
@@ -104,7 +326,13 @@ int main(int argc, char* argv[]) {
 * arg: struct containing args that are to be passed to the function
 */
 void* stdin_thread(void* arg) {
-    FILE* to = (FILE *) arg;
+    StdinArgs* args = arg;
+    FILE* to = args->to;
+    if (args->stats) {
+        batch_stdin(to, args->stats);
+        report_rate(args->stats);
+        exit(0);
+    }
     char* stdinLine;
     while ((stdinLine = read_line(stdin))) {
         fprintf(to, "%s\n", stdinLine);
@@ -113,19 +341,198 @@ void* stdin_thread(void* arg) {
     exit(0);
 }
 
-/* int is_valid_string(char* s)
+/* void batch_stdin(FILE* to, BatchStats* stats)
 * -----------------------------------------------
-* Checks if the passed string is valid or not
+* Copies stdin to the server a block at a time until end of file. Only
+* whole lines are sent, with any partial line at the end of a block carried
+* over to the next, so a heartbeat reply sent by the main thread between
+* blocks never lands inside a line. A newline is added if the input
+* doesn't end with one.
 *
-* s: string to be checked
-* 
-* Returns: 0, if invalid
-*          1, if valid
+* to: stream to the server
+* stats: message counts to update
 */
-int is_valid_string(char* s) {
-    if (strchr(s, ' ') || strchr(s, ':') || strchr(s, '\n')) {
-        return 0;
-    } else {
-        return 1;
+void batch_stdin(FILE* to, BatchStats* stats) {
+    size_t size = BATCH_BLOCK;
+    char* buf = malloc(size);
+    size_t held = 0;
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, buf + held, size - held)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        size_t len = held + n;
+        size_t whole = len;
+        while (whole > 0 && buf[whole - 1] != '\n') {
+            whole--;
+        }
+        if (whole > 0) {
+            fwrite(buf, 1, whole, to);
+            fflush(to);
+            __atomic_add_fetch(&stats->sent, count_lines(buf, whole),
+                    __ATOMIC_RELAXED);
+        }
+        held = len - whole;
+        memmove(buf, buf + whole, held);
+        if (held == size) {
+            // A line longer than the buffer
+            size *= 2;
+            buf = realloc(buf, size);
+        }
+    }
+    if (held > 0) {
+        buf[held++] = '\n';
+        fwrite(buf, 1, held, to);
+        fflush(to);
+        __atomic_add_fetch(&stats->sent, 1, __ATOMIC_RELAXED);
+    }
+    free(buf);
+}
+
+/* void batch_receive(int fd, ShmLink* link, FILE* to, BatchStats* stats)
+* -----------------------------------------------
+* Copies everything received from the server to stdout a block at a time,
+* until the server closes the connection. Heartbeats are answered rather
+* than copied.
+*
+* fd: socket connected to the server
+* link: shared memory link to read from instead of fd, or NULL
+* to: stream to the server
+* stats: message counts to update
+*/
+void batch_receive(int fd, ShmLink* link, FILE* to, BatchStats* stats) {
+    char* buf = malloc(BATCH_BLOCK);
+    setvbuf(stdout, NULL, _IOFBF, BATCH_BLOCK);
+    HeartbeatFilter filter = {.held = 0, .midLine = false};
+    ssize_t n;
+    while (1) {
+        char* space = buf + filter.held;
+        size_t spaceLen = BATCH_BLOCK - filter.held;
+        n = link ? shm_link_read(link, space, spaceLen)
+                : read(fd, space, spaceLen);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        int beats = 0;
+        size_t out = strip_heartbeats(buf, filter.held + n, &filter, &beats);
+        fwrite(buf, 1, out, stdout);
+        fflush(stdout);
+        __atomic_add_fetch(&stats->received, count_lines(buf, out),
+                __ATOMIC_RELAXED);
+        memmove(buf, buf + out, filter.held);
+        while (beats-- > 0) {
+            send_heartbeat_reply(to);
+        }
     }
+    free(buf);
+}
+
+/* size_t strip_heartbeats(char* buf, size_t len, HeartbeatFilter* filter,
+*         int* beats)
+* -----------------------------------------------
+* Removes heartbeat lines from a block received from the server. A partial
+* line at the end of the block that may still turn out to be a heartbeat is
+* held back for the next block.
+*
+* buf: the block, starting with any bytes held back from the last one
+* len: length of buf in bytes
+* filter: state carried between blocks, updated with the bytes held back
+* beats: set to the number of heartbeats removed
+*
+* Returns: number of bytes at the start of buf to be output; any bytes held
+*          back follow them
+*/
+size_t strip_heartbeats(char* buf, size_t len, HeartbeatFilter* filter,
+        int* beats) {
+    size_t hbLen = strlen(HEARTBEAT);
+    size_t out = 0;
+    size_t i = 0;
+    filter->held = 0;
+    while (i < len) {
+        char* newline = memchr(buf + i, '\n', len - i);
+        size_t lineLen = newline ? (size_t) (newline - buf) - i + 1 : len - i;
+        bool lineStart = !filter->midLine;
+        filter->midLine = (newline == NULL);
+        if (lineStart && lineLen == hbLen
+                && memcmp(buf + i, HEARTBEAT, hbLen) == 0) {
+            (*beats)++;
+        } else if (lineStart && !newline && lineLen < hbLen
+                && memcmp(buf + i, HEARTBEAT, lineLen) == 0) {
+            filter->held = lineLen;
+            filter->midLine = false;
+            memmove(buf + out, buf + i, lineLen);
+            break;
+        } else {
+            if (out != i) {
+                memmove(buf + out, buf + i, lineLen);
+            }
+            out += lineLen;
+        }
+        i += lineLen;
+    }
+    return out;
+}
+
+/* void send_heartbeat_reply(FILE* to)
+* -----------------------------------------------
+* Answers a heartbeat from the server, so an idle subscriber isn't
+* disconnected
+*
+* to: stream to the server
+*/
+void send_heartbeat_reply(FILE* to) {
+    fputs(HEARTBEAT_REPLY, to);
+    fflush(to);
+}
+
+/* unsigned long count_lines(const char* buf, size_t len)
+* -----------------------------------------------
+* Counts the newlines in a buffer
+*
+* buf: the buffer to be searched
+* len: length of buf in bytes
+*
+* Returns: number of newlines found
+*/
+unsigned long count_lines(const char* buf, size_t len) {
+    unsigned long lines = 0;
+    const char* end = buf + len;
+    while ((buf = memchr(buf, '\n', end - buf))) {
+        lines++;
+        buf++;
+    }
+    return lines;
+}
+
+/* void report_rate(BatchStats* stats)
+* -----------------------------------------------
+* Prints the number of lines sent and received, and the rates achieved, to
+* stderr
+*
+* stats: message counts to report
+*/
+void report_rate(BatchStats* stats) {
+    double secs = (now_ns() - stats->startNs) / 1e9;
+    unsigned long sent = __atomic_load_n(&stats->sent, __ATOMIC_RELAXED);
+    unsigned long received = __atomic_load_n(&stats->received,
+            __ATOMIC_RELAXED);
+    fprintf(stderr, "psclient: sent %lu lines (%.0f/s), received %lu lines "
+            "(%.0f/s) in %.3fs\n", sent, sent / secs, received,
+            received / secs, secs);
+}
+
+/* uint64_t now_ns(void)
+* -----------------------------------------------
+* Returns: the current monotonic time in nanoseconds
+*/
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
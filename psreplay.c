@@ -0,0 +1,537 @@
+// psreplay.c
+// Author: Rohith Kotia Palakirti
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include "capture.h"
+
+// Size of the blocks read from the server
+#define READ_BLOCK 65536
+// Most sockets reported by one epoll_wait()
+#define MAX_EVENTS 64
+// Time between latency probes
+#define PROBE_INTERVAL_NS 1000000ULL
+// Number of probe send times remembered (probes older than this are lost)
+#define PROBE_SLOTS 65536
+// Time the server must have been quiet for before the replay is finished
+#define DRAIN_NS 500000000ULL
+// Heartbeat sent by the server, and the reply that keeps a connection from
+// being disconnected as idle
+#define HEARTBEAT_LINE ":heartbeat\n"
+#define HEARTBEAT_REPLY "heartbeat\n"
+
+/*
+* Struct Definitions
+*/
+
+/* Replay Struct
+* -----------------------------------------------
+* Structure to hold the state of a replay, shared by its threads
+* events: the events of the capture, in order
+* eventCount: number of events
+* connCount: one more than the highest captured connection ID
+* epollFd: epoll instance the reader thread waits on for replies
+* portNum: port number or socket path of the server
+* speed: how many times faster than captured to replay, 0 for as fast as
+*        possible
+* startNs: time (ns, CLOCK_MONOTONIC) the replay started
+* sent: lines sent to the server (updated by the sender)
+* received: lines received from the server (updated by the reader thread)
+* lastReceiveNs: time the last block was received from the server
+* probeTopic: topic the latency probes are published to
+* probeFd: connection the probes are published on
+* probeFrom: stream from the connection subscribed to probeTopic
+* probeSent: time each probe was sent, indexed by sequence number modulo
+*            PROBE_SLOTS
+* probes: number of probes sent
+* latencies: latency (ns) of each probe received, in order of arrival
+* latencyCount, latencySize: number of latencies, and room in latencies
+* latencyLock: held while latencies is changed or read
+* running: cleared to stop the probe thread
+*/
+typedef struct Replay {
+    CaptureEvent* events;
+    size_t eventCount;
+    uint32_t connCount;
+    int epollFd;
+    const char* portNum;
+    double speed;
+    uint64_t startNs;
+    unsigned long sent;
+    unsigned long received;
+    uint64_t lastReceiveNs;
+    char probeTopic[64];
+    int probeFd;
+    FILE* probeFrom;
+    uint64_t probeSent[PROBE_SLOTS];
+    unsigned long probes;
+    uint64_t* latencies;
+    size_t latencyCount;
+    size_t latencySize;
+    pthread_mutex_t latencyLock;
+    bool running;
+} Replay;
+
+/*
+ * Function Prototypes
+ */
+void load_capture(Replay* r, const char* path);
+void replay_events(Replay* r);
+FILE* open_connection(Replay* r);
+void* reader_thread(void* arg);
+void* probe_thread(void* arg);
+void* probe_reader_thread(void* arg);
+void wait_for_drain(Replay* r);
+void report(Replay* r, uint64_t endNs);
+int compare_latency(const void* a, const void* b);
+int connect_server(const char* portNum);
+void sleep_until(uint64_t whenNs);
+uint64_t now_ns(void);
+void print_usage();
+
+/* int main(int argc, char *argv[])
+* -----------------------------------------------
+* Replays a capture file recorded by psserver --capture against a server.
+* Every captured connection is opened, sent its lines and closed in the
+* order and (scaled) timing captured. A probe connection publishes to a
+* topic of its own every PROBE_INTERVAL_NS throughout, and another
+* subscribed to it measures how long the probes take to arrive.
+*
+* argc: count of number of commandline arguments
+* argv: the array of commandline arguments stored as strings
+*
+* portnum may also be the path of the server's unix domain socket (any
+* argument containing a '/').
+*
+* Options (must come before capturefile):
+*   --speed N|max  replay N times faster than captured (default 1), or
+*                  without waiting between events
+*
+* Returns: 0 on successful termination
+* Errors: program exits with code 1 if the input is invalid
+*                            code 2 if the capture file can't be read
+*                            code 3 if connection to port fails
+*/
+int main(int argc, char* argv[]) {
+    Replay* r = calloc(1, sizeof(Replay));
+    r->speed = 1;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--speed") == 0 && argc > 2) {
+            char* end;
+            r->speed = strtod(argv[2], &end);
+            if (strcmp(argv[2], "max") == 0) {
+                r->speed = 0;
+            } else if (*end != '\0' || end == argv[2] || !(r->speed > 0)) {
+                print_usage();
+            }
+            argc--;
+            argv++;
+        } else {
+            print_usage();
+        }
+        argc--;
+        argv++;
+    }
+    if (argc != 3) {
+        print_usage();
+    }
+    signal(SIGPIPE, SIG_IGN); // Captured clients may be disconnected early
+    load_capture(r, argv[1]);
+    r->portNum = argv[2];
+    r->epollFd = epoll_create1(0);
+    snprintf(r->probeTopic, sizeof(r->probeTopic), "psreplay-probe-%d",
+            (int) getpid());
+    int probeSub = connect_server(r->portNum);
+    dprintf(probeSub, "name psreplay\nsub %s\n", r->probeTopic);
+    r->probeFrom = fdopen(probeSub, "r");
+    r->probeFd = connect_server(r->portNum);
+    dprintf(r->probeFd, "name psreplay\n");
+    r->running = true;
+    pthread_mutex_init(&r->latencyLock, NULL);
+    r->latencySize = 1024;
+    r->latencies = malloc(sizeof(uint64_t) * r->latencySize);
+    pthread_t threadIds[3];
+    pthread_create(&threadIds[0], NULL, reader_thread, r);
+    pthread_create(&threadIds[1], NULL, probe_reader_thread, r);
+    pthread_create(&threadIds[2], NULL, probe_thread, r);
+    pthread_detach(threadIds[0]);
+    pthread_detach(threadIds[1]);
+    r->startNs = now_ns();
+    replay_events(r);
+    uint64_t endNs = now_ns();
+    wait_for_drain(r);
+    __atomic_store_n(&r->running, false, __ATOMIC_RELAXED);
+    pthread_join(threadIds[2], NULL);
+    report(r, endNs);
+    return 0;
+}
+
+/* void load_capture(Replay* r, const char* path)
+* -----------------------------------------------
+* Reads every event of a capture file into memory, so reading the file
+* can't hold up the replay
+*
+* r: populated with the events and the number of connections
+* path: the capture file
+*
+* Errors: program exits with code 2 if the file can't be read
+*/
+void load_capture(Replay* r, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file || !capture_check(file)) {
+        fprintf(stderr, "psreplay: unable to read capture file %s\n", path);
+        exit(2);
+    }
+    size_t size = 1024;
+    r->events = malloc(sizeof(CaptureEvent) * size);
+    CaptureEvent event = {.timeUs = 0};
+    while (capture_read(file, &event)) {
+        if (r->eventCount == size) {
+            size *= 2;
+            r->events = realloc(r->events, sizeof(CaptureEvent) * size);
+        }
+        r->events[r->eventCount++] = event;
+        if (event.conn >= r->connCount) {
+            r->connCount = event.conn + 1;
+        }
+    }
+    fclose(file);
+}
+
+/* void replay_events(Replay* r)
+* -----------------------------------------------
+* Sends the captured events to the server in order. Lines are buffered per
+* connection, and a connection's buffer is sent before any other connection
+* is written to or the replay waits, so the server sees lines in the
+* captured order without a write for every line. When replaying as fast as
+* possible, connections are left open until psreplay exits rather than
+* closed when captured, so the messages published to them are still
+* delivered and counted.
+*
+* r: the replay
+*/
+void replay_events(Replay* r) {
+    FILE** files = calloc(r->connCount, sizeof(FILE*));
+    FILE* pending = NULL;
+    for (size_t i = 0; i < r->eventCount; i++) {
+        CaptureEvent* e = &r->events[i];
+        if (r->speed > 0) {
+            uint64_t when = r->startNs + (uint64_t) (e->timeUs * 1000.0
+                    / r->speed);
+            if (when > now_ns()) {
+                if (pending) {
+                    fflush(pending);
+                    pending = NULL;
+                }
+                sleep_until(when);
+            }
+        }
+        FILE* f = files[e->conn];
+        if (pending && pending != f) {
+            fflush(pending);
+            pending = NULL;
+        }
+        if (e->type == CAPTURE_OPEN && !f) {
+            files[e->conn] = open_connection(r);
+        } else if (e->type == CAPTURE_LINE && f) {
+            fwrite(e->line, 1, e->len, f);
+            putc('\n', f);
+            pending = f;
+            r->sent++;
+        } else if (e->type == CAPTURE_CLOSE && f && r->speed > 0) {
+            fclose(f); // Also closes the socket, removing it from epoll
+            files[e->conn] = NULL;
+        }
+    }
+    if (pending) {
+        fflush(pending);
+    }
+    free(files);
+}
+
+/* FILE* open_connection(Replay* r)
+* -----------------------------------------------
+* Connects to the server for a captured connection, and has the reader
+* thread count what is sent back on it
+*
+* r: the replay
+*
+* Returns: stream to write the connection's lines to
+* Errors: program exits with code 3 if the connection fails
+*/
+FILE* open_connection(Replay* r) {
+    int fd = connect_server(r->portNum);
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    epoll_ctl(r->epollFd, EPOLL_CTL_ADD, fd, &ev);
+    FILE* f = fdopen(fd, "w");
+    setvbuf(f, NULL, _IOFBF, READ_BLOCK);
+    return f;
+}
+
+/* void* reader_thread(void* arg)
+* -----------------------------------------------
+* Thread function that reads and counts the lines the server sends on every
+* replayed connection
+*
+* arg: the Replay
+*
+* Returns: NULL (never returns)
+*/
+void* reader_thread(void* arg) {
+    Replay* r = arg;
+    struct epoll_event events[MAX_EVENTS];
+    char* buf = malloc(READ_BLOCK);
+    while (1) {
+        int n = epoll_wait(r->epollFd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            ssize_t got = read(events[i].data.fd, buf, READ_BLOCK);
+            if (got <= 0) {
+                // Closed by the server; the sender closes its end
+                epoll_ctl(r->epollFd, EPOLL_CTL_DEL, events[i].data.fd,
+                        NULL);
+                continue;
+            }
+            unsigned long lines = 0;
+            for (const char* p = buf; (p = memchr(p, '\n', buf + got - p));
+                    p++) {
+                lines++;
+            }
+            __atomic_add_fetch(&r->received, lines, __ATOMIC_RELAXED);
+            __atomic_store_n(&r->lastReceiveNs, now_ns(), __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/* void* probe_thread(void* arg)
+* -----------------------------------------------
+* Thread function that publishes a numbered probe every PROBE_INTERVAL_NS
+* until the replay is finished
+*
+* arg: the Replay
+*
+* Returns: NULL
+*/
+void* probe_thread(void* arg) {
+    Replay* r = arg;
+    uint64_t next = now_ns();
+    while (__atomic_load_n(&r->running, __ATOMIC_RELAXED)) {
+        unsigned long seq = r->probes;
+        __atomic_store_n(&r->probeSent[seq % PROBE_SLOTS], now_ns(),
+                __ATOMIC_RELEASE);
+        dprintf(r->probeFd, "pub %s %lu\n", r->probeTopic, seq);
+        __atomic_store_n(&r->probes, seq + 1, __ATOMIC_RELAXED);
+        next += PROBE_INTERVAL_NS;
+        sleep_until(next);
+    }
+    return NULL;
+}
+
+/* void* probe_reader_thread(void* arg)
+* -----------------------------------------------
+* Thread function that receives the probes ("psreplay:topic:seq" lines)
+* and records how long each took to arrive. Lines from the server itself
+* (starting with ':') aren't probes, and heartbeats are answered so the
+* server doesn't disconnect the subscriber as idle. The publisher needs no
+* replies as its probes count as input.
+*
+* arg: the Replay
+*
+* Returns: NULL
+*/
+void* probe_reader_thread(void* arg) {
+    Replay* r = arg;
+    char* line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, r->probeFrom) > 0) {
+        uint64_t arrived = now_ns();
+        if (line[0] == ':') {
+            if (strcmp(line, HEARTBEAT_LINE) == 0) {
+                dprintf(fileno(r->probeFrom), HEARTBEAT_REPLY);
+            }
+            continue;
+        }
+        char* seqStr = strrchr(line, ':');
+        if (!seqStr) {
+            continue;
+        }
+        unsigned long seq = strtoul(seqStr + 1, NULL, 10);
+        uint64_t sentAt = __atomic_load_n(&r->probeSent[seq % PROBE_SLOTS],
+                __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&r->probes, __ATOMIC_RELAXED) - seq
+                > PROBE_SLOTS) {
+            continue; // Its send time has been overwritten
+        }
+        pthread_mutex_lock(&r->latencyLock);
+        if (r->latencyCount == r->latencySize) {
+            r->latencySize *= 2;
+            r->latencies = realloc(r->latencies,
+                    sizeof(uint64_t) * r->latencySize);
+        }
+        r->latencies[r->latencyCount++] = arrived - sentAt;
+        pthread_mutex_unlock(&r->latencyLock);
+    }
+    free(line);
+    return NULL;
+}
+
+/* void wait_for_drain(Replay* r)
+* -----------------------------------------------
+* Waits until nothing has been received on the replayed connections for
+* DRAIN_NS, so messages still being fanned out are counted
+*
+* r: the replay
+*/
+void wait_for_drain(Replay* r) {
+    uint64_t quietSince = now_ns();
+    unsigned long seen = __atomic_load_n(&r->received, __ATOMIC_RELAXED);
+    while (now_ns() - quietSince < DRAIN_NS) {
+        sleep_until(now_ns() + DRAIN_NS / 10);
+        unsigned long received = __atomic_load_n(&r->received,
+                __ATOMIC_RELAXED);
+        if (received != seen) {
+            seen = received;
+            quietSince = now_ns();
+        }
+    }
+}
+
+/* void report(Replay* r, uint64_t endNs)
+* -----------------------------------------------
+* Prints the throughput achieved and the probe latencies to stderr
+*
+* r: the replay
+* endNs: time the last event was sent
+*/
+void report(Replay* r, uint64_t endNs) {
+    double sendSecs = (endNs - r->startNs) / 1e9;
+    uint64_t lastNs = __atomic_load_n(&r->lastReceiveNs, __ATOMIC_RELAXED);
+    double receiveSecs = ((lastNs > endNs) ? lastNs - r->startNs
+            : endNs - r->startNs) / 1e9;
+    unsigned long received = __atomic_load_n(&r->received,
+            __ATOMIC_RELAXED);
+    fprintf(stderr, "psreplay: replayed %zu events on %u connections in "
+            "%.3fs\n", r->eventCount, r->connCount, sendSecs);
+    fprintf(stderr, "psreplay: sent %lu lines (%.0f/s), received %lu lines "
+            "(%.0f/s)\n", r->sent, r->sent / sendSecs, received,
+            received / receiveSecs);
+    pthread_mutex_lock(&r->latencyLock);
+    size_t n = r->latencyCount;
+    if (n == 0) {
+        fprintf(stderr, "psreplay: no probes received\n");
+    } else {
+        qsort(r->latencies, n, sizeof(uint64_t), compare_latency);
+        fprintf(stderr, "psreplay: probe latency p50 %.1fus, p99 %.1fus, "
+                "max %.1fus (%zu of %lu probes)\n",
+                r->latencies[n / 2] / 1e3, r->latencies[n * 99 / 100] / 1e3,
+                r->latencies[n - 1] / 1e3, n, r->probes);
+    }
+    pthread_mutex_unlock(&r->latencyLock);
+}
+
+/* int compare_latency(const void* a, const void* b)
+* -----------------------------------------------
+* Orders latencies for qsort()
+*
+* a, b: the latencies to compare
+*
+* Returns: negative, zero or positive as a is less than, equal to or greater
+*          than b
+*/
+int compare_latency(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/* int connect_server(const char* portNum)
+* -----------------------------------------------
+* Connects to the server over TCP on localhost, or over a unix domain socket
+* if portNum is a path
+*
+* portNum: port number or socket path of the server
+*
+* Returns: the connected socket
+* Errors: program exits with code 3 if the connection fails
+*/
+int connect_server(const char* portNum) {
+    if (strchr(portNum, '/')) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(struct sockaddr_un));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, portNum, sizeof(addr.sun_path) - 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (strlen(portNum) >= sizeof(addr.sun_path) || connect(fd,
+                (struct sockaddr *)&addr, sizeof(struct sockaddr_un))) {
+            fprintf(stderr, "psreplay: unable to connect to port %s\n",
+                    portNum);
+            exit(3);
+        }
+        return fd;
+    }
+    struct addrinfo* ai = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("localhost", portNum, &hints, &ai)) {
+        fprintf(stderr, "psreplay: unable to connect to port %s\n", portNum);
+        exit(3);
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)ai->ai_addr, sizeof(struct sockaddr))) {
+        fprintf(stderr, "psreplay: unable to connect to port %s\n", portNum);
+        exit(3);
+    }
+    freeaddrinfo(ai);
+    return fd;
+}
+
+/* void sleep_until(uint64_t whenNs)
+* -----------------------------------------------
+* Sleeps until a time has been reached
+*
+* whenNs: the time (ns, CLOCK_MONOTONIC) to wake at
+*/
+void sleep_until(uint64_t whenNs) {
+    struct timespec ts = {.tv_sec = whenNs / 1000000000ULL,
+            .tv_nsec = whenNs % 1000000000ULL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+            == EINTR) {
+    }
+}
+
+/* uint64_t now_ns(void)
+* -----------------------------------------------
+* Returns: the current monotonic time in nanoseconds
+*/
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* void print_usage()
+* -----------------------------------------------
+* Prints the usage message
+* Exits with code 1
+*/
+void print_usage() {
+    fprintf(stderr, "Usage: psreplay [--speed N|max] capturefile portnum\n");
+    exit(1);
+}
@@ -1,8 +1,11 @@
 // psserver.c
 // Author: Rohith Kotia Palakirti
 
+#define _GNU_SOURCE // For thread CPU affinity
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -19,37 +22,197 @@
 #include <semaphore.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include "shmring.h"
+#include "fanout.h"
+#include "delimscan.h"
+#include "timerwheel.h"
+#include "filter.h"
+#include "capture.h"
+
+// Maximum number of messages accepted in a single mpub batch
+#define MAX_BATCH 65536
+// Number of buckets in each rate limiter table (must be a power of two)
+#define RATE_SLOTS 4096
+// Number of slots probed when looking up a rate limiter bucket
+#define RATE_PROBES 8
+// Initial size of each client's input buffer
+#define INPUT_BUFFER 4096
+// Largest output buffer and delay a client can ask for with "coalesce"
+#define MAX_COALESCE_BYTES (1 << 20)
+#define MAX_COALESCE_USEC 1000000
+// Most subscriptions, topics or clients reclaimed per hold of the guard
+#define COMPACT_BATCH 64
+// Time garbage is left to build up before it is reclaimed
+#define COMPACT_DELAY_USEC 100000
+// Resolution of idle timeouts, heartbeats and coalescing deadlines
+#define TIMER_TICK_NS 1000000ULL
+// Line sent to clients when a heartbeat is due
+#define HEARTBEAT ":heartbeat\n"
+// Longest a send to a client may block before the client is disconnected
+#define SEND_TIMEOUT_MS 1000
 
 /*
 * Struct Definitions
 */
 
+/* RateBucket Struct
+* -----------------------------------------------
+* A single token bucket, stored as the "theoretical arrival time" of the
+* next message (GCRA form) so it can be updated with one compare-and-swap
+* key: hash of the client name or topic owning the bucket, 0 if unused
+* tat: time (ns, CLOCK_MONOTONIC) at which the bucket will be full again
+*/
+typedef struct RateBucket {
+    uint64_t key;
+    uint64_t tat;
+} RateBucket;
+
+/* RateLimiter Struct
+* -----------------------------------------------
+* A fixed size, lock free table of token buckets keyed by string
+* interval: ns between tokens, 0 if the limiter is disabled
+* tolerance: ns of burst allowed (burst size * interval)
+* buckets: RATE_SLOTS buckets, open addressed by key hash
+*/
+typedef struct RateLimiter {
+    uint64_t interval;
+    uint64_t tolerance;
+    RateBucket* buckets;
+} RateLimiter;
+
+/* Limits Struct
+* -----------------------------------------------
+* Structure to hold the publish rate limits of the server
+* client: limiter keyed by client name
+* topic: limiter keyed by topic
+*/
+typedef struct Limits {
+    RateLimiter client;
+    RateLimiter topic;
+} Limits;
+
+/* ServerOptions Struct
+* -----------------------------------------------
+* Structure to hold the optional startup settings of the server
+* clientRate, clientBurst: per client name publish limit (0 for none)
+* topicRate, topicBurst: per topic publish limit (0 for none)
+* unixPath: path of the unix domain socket to listen on (NULL for none)
+* useUring: flag to send fan-out writes through io_uring
+* idleSecs: seconds without input after which a client is disconnected
+*           (0 for never)
+* heartbeatSecs: seconds between heartbeats sent to each client (0 for none)
+* capturePath: path of the file to record client input to (NULL for none)
+* capture: the opened capture file (NULL for none)
+* cpus, cpuCount: CPUs the server's threads may run on (cpuCount 0 for any)
+*/
+typedef struct ServerOptions {
+    int clientRate;
+    int clientBurst;
+    int topicRate;
+    int topicBurst;
+    char* unixPath;
+    bool useUring;
+    int idleSecs;
+    int heartbeatSecs;
+    char* capturePath;
+    Capture* capture;
+    int* cpus;
+    int cpuCount;
+} ServerOptions;
+
 /* Client Struct
 * -----------------------------------------------
 * Structure to hold properties of each client
 * id: unique ID of the client
-* fd: file descriptor to the open socker
+* fd: the client's socket, kept open until the client is closed so that
+*     any thread can shut it down
 * fileRead: fdopen'd fd for reading
 * fileWrite: fdopen'd fd for writing
 * name: name of the client
 * threadId: threadId of the thread running the client
 * active: flag to indicate if the client is active
+* hungUp: set (atomically) once the connection has been shut down, after
+*         which nothing more is sent to the client
 * sm: StringMap data structure to hold topics and subscribed clients
 * guard: sempahore guard to lock data structures
+* limits: publish rate limits shared by all clients
+* fanout: ring used to send published messages to subscribers' sockets
+* local: flag to indicate the client connected over the unix domain socket
+* shm: shared memory link used in place of the socket, NULL if not in use
+* timers: timer thread state shared by all clients
+* coalesceBytes: size at which buffered messages are sent, 0 if messages
+*                are sent immediately
+* coalesceUsec: longest time a message may be buffered for
+* outBuf, outLen: messages buffered for this client
+* flushTimer: pending while outBuf holds messages, expires when they must
+*             be sent
+* idleTimer: expires when the client may have been idle for too long
+* heartbeatTimer: expires when the next heartbeat is due
+* lastInput: time (ns, CLOCK_MONOTONIC) input was last read from the client
+* inBuf: bytes read from the client, inSize + 1 bytes long
+* inStart, inEnd: the unprocessed bytes in inBuf
+* subs: topics the client is subscribed to, mapped to their ClientArray
+* compactor: reclaims the client and its subscriptions once it disconnects
+* capture: capture file the client's input is recorded to, NULL if none
+* cpu: CPU the client's thread is pinned to, -1 if it isn't
 */
 typedef struct Client {
     int id;
-    int* fd;
+    int fd;
     FILE* fileRead;
     FILE* fileWrite;
     char* name;
     pthread_t threadId;
     bool active;
+    bool hungUp;
     sem_t* guard;
     StringMap* sm;
     int* statistics;
+    Limits* limits;
+    FanoutRing* fanout;
+    bool local;
+    ShmLink* shm;
+    struct TimerService* timers;
+    size_t coalesceBytes;
+    long coalesceUsec;
+    char* outBuf;
+    size_t outLen;
+    Timer flushTimer;
+    Timer idleTimer;
+    Timer heartbeatTimer;
+    uint64_t lastInput;
+    char* inBuf;
+    size_t inStart;
+    size_t inEnd;
+    size_t inSize;
+    StringMap* subs;
+    struct Compactor* compactor;
+    Capture* capture;
+    int cpu;
 } Client;
 
+/* Command Struct
+* -----------------------------------------------
+* Structure to hold a command line split up by parse_command()
+* name: the command
+* args: everything after the first space, NULL if there is none
+* rest: everything after the second space, NULL if there is none
+* restLen: length of rest
+* argsValid: flag to indicate args is non-empty and contains no space or
+*            colon
+*/
+typedef struct Command {
+    char* name;
+    char* args;
+    char* rest;
+    size_t restLen;
+    bool argsValid;
+} Command;
+
 /* Args Struct
 * -----------------------------------------------
 * Structure to hold the arguments that are passed to each new thread
@@ -61,9 +224,23 @@ typedef struct Args {
     int clientCount;
 } Args;
 
+/* SigArgs Struct
+* -----------------------------------------------
+* Structure to hold the arguments passed to the signal handling thread
+* set: the signals to wait for
+* statistics: the server's statistics (protected by guard)
+* compactor: holds the server's gauges (protected by guard)
+* fanout: counts the sends made to subscribers (protected by guard)
+* guard: sempahore guard to lock data structures
+* capture: capture file written out on SIGINT or SIGTERM, NULL if none
+*/
 typedef struct SigArgs {
     sigset_t* set;
     int* statistics;
+    struct Compactor* compactor;
+    FanoutRing* fanout;
+    sem_t* guard;
+    Capture* capture;
 } SigArgs;
 
 // Reference; https://stackoverflow.com/questions/3536153/c-dynamicall
@@ -76,20 +253,109 @@ typedef struct SigArgs {
 * used: current utilized size of array
 * size: size of array
 * count: number of clients in array
+* groups: for a topic's subscribers, those that subscribed with a filter,
+*         grouped by filter (client only holds those without one)
 */
 typedef struct ClientArray {
     Client** client;
     size_t used;
     size_t size;
     int count;
+    struct FilterGroup* groups;
 } ClientArray;
 
+/* FilterGroup Struct
+* -----------------------------------------------
+* Structure to hold the subscribers of a topic that share a filter, so the
+* filter is run once per message however many of them there are
+* filter: the compiled filter
+* members: the subscribers
+* next: the topic's next group
+*/
+typedef struct FilterGroup {
+    Filter filter;
+    ClientArray members;
+    struct FilterGroup* next;
+} FilterGroup;
+
+/* TimerService Struct
+* -----------------------------------------------
+* Structure to hold the state of the thread that runs the server's timers.
+* Every client has an idle, heartbeat and flush timer, so these live in
+* timer wheels where adding and cancelling one is O(1) however many clients
+* there are. Idle timers only shut down sockets, so they have a wheel of
+* their own that is run without the guard, and a client stuck sending under
+* the guard can still be disconnected.
+* wheel: the flush and heartbeat timers (protected by guard)
+* idleWheel: the idle timers (protected by idleLock)
+* idleLock: mutex protecting idleWheel
+* guard: sempahore guard to lock data structures
+* wake: posted when a timer is added that expires before wakeAt
+* wakeAt: time (ns, CLOCK_MONOTONIC) the timer thread will next wake
+*         (accessed atomically)
+* idleNs: time without input after which a client is disconnected, 0 for
+*         never
+* heartbeatNs: time between heartbeats, 0 for none
+*/
+typedef struct TimerService {
+    TimerWheel wheel;
+    TimerWheel idleWheel;
+    pthread_mutex_t idleLock;
+    sem_t* guard;
+    sem_t wake;
+    uint64_t wakeAt;
+    uint64_t idleNs;
+    uint64_t heartbeatNs;
+} TimerService;
+
+/* Gauges Struct
+* -----------------------------------------------
+* Structure to hold the current size of the server's data structures
+* topics: number of topics in the StringMap
+* subscriptions: number of subscriptions, including those of disconnected
+*                clients that have not been reclaimed yet
+* clients: number of Client structs that have not been freed
+* bytes: approximate memory held by topics, subscriptions and clients
+*        (updated atomically, as input buffers grow without the guard)
+*/
+typedef struct Gauges {
+    int topics;
+    int subscriptions;
+    int clients;
+    long bytes;
+} Gauges;
+
+/* Compactor Struct
+* -----------------------------------------------
+* Structure to hold the state of the thread that reclaims disconnected
+* clients and topics left without subscribers. Reclamation is deferred to
+* this thread and done a batch at a time so publishers are never held up
+* behind it.
+* dead: disconnected clients waiting to be reclaimed (protected by guard)
+* empty: topics whose last subscriber has left, mapped to their ClientArray
+*        (protected by guard)
+* sm: StringMap data structure to hold topics and subscribed clients
+* guard: sempahore guard to lock data structures
+* wake: posted when a client or topic is added to be reclaimed
+* gauges: the current size of the server's data structures (protected by
+*         guard, except bytes)
+*/
+typedef struct Compactor {
+    ClientArray dead;
+    StringMap* empty;
+    StringMap* sm;
+    sem_t* guard;
+    sem_t wake;
+    Gauges gauges;
+} Compactor;
+
 /*
  * Function Prototypes
  */
 void* client_thread(void*);
 int open_listen(const char* port, int connections);
-void process_connections(int fdServer);
+void process_connections(int fdServer, int fdUnix, ServerOptions* options,
+        sigset_t* set);
 void init_client_array(ClientArray* a, size_t initialSize);
 int insert_client_array(ClientArray* a, Client* element);
 void remove_client(ClientArray* a, int index);
@@ -98,14 +364,70 @@ void print_client_array(ClientArray* a, StringMap* sm);
 void free_client_array(ClientArray* a);
 void init_lock(sem_t* l);
 void take_lock(sem_t* l);
+bool take_lock_until(sem_t* l, uint64_t whenNs);
 void release_lock(sem_t* l);
-int is_valid_string(char* s);
 void* sig_thread(void* arg);
 int open_listen(const char* port, int connections);
-void process_connections(int fdServer);
+int open_unix_listen(const char* path, int connections);
+void process_connections(int fdServer, int fdUnix, ServerOptions* options,
+        sigset_t* set);
+int parse_options(int argc, char* argv[], ServerOptions* options,
+        char** positional);
+int parse_rate(char* s, int* rate, int* burst);
+int parse_seconds(char* s);
+int parse_cpus(char* s, int** cpus);
+bool pin_thread(int* cpus, int count);
+void init_rate_limiter(RateLimiter* rl, int rate, int burst);
+int rate_allow(RateLimiter* rl, const char* key, int count);
+uint64_t now_ns(void);
+int check_limits(Client* client, char* topic, int count);
 void* client_thread(void* arg);
+char* read_frame(Client* c, DelimScan* scan, size_t* len);
+ssize_t read_input(Client* c, char* buf, size_t len);
+void parse_command(char* line, size_t len, DelimScan* scan, Command* cmd);
+void send_invalid(Client* client);
+void send_reply_locked(Client* client, const char* reply);
+void handle_shm(Client* client);
+void handle_name(Client* client, Command* cmd);
+char* command_topic(Command* cmd);
+void handle_sub(Client* client, Command* cmd);
+void handle_pub(Client* client, Command* cmd);
+void handle_unsub(Client* client, char* topic);
+int handle_mpub(Client* client, Command* cmd);
+int parse_batch_count(char* s);
+void publish(Client* client, char* topic, char** payloads, size_t* lengths,
+        int count);
+void fan_out(Client* client, ClientArray* subs, const char* buf, size_t len);
+void deliver(Client* c, const char* buf, size_t len);
+bool topic_empty(ClientArray* a);
+bool is_subscribed(ClientArray* a, Client* c);
+void add_filtered(ClientArray* a, Client* c, Filter* filter);
+bool unsubscribe(ClientArray* a, Client* c);
+void handle_coalesce(Client* client, char* args);
+void send_output(Client* c, const char* buf, size_t len);
+void buffer_output(Client* c, const char* buf, size_t len);
+void flush_output(Client* c);
+void arm_timer(TimerService* ts, Timer* timer, uint64_t whenNs);
+void arm_idle_timer(TimerService* ts, Timer* timer, uint64_t whenNs);
+void wake_timers(TimerService* ts, uint64_t whenNs);
+void realtime_deadline(uint64_t whenNs, struct timespec* deadline);
+void* timer_thread(void* arg);
+void flush_expired(Timer* timer, void* arg);
+void idle_expired(Timer* timer, void* arg);
+void heartbeat_expired(Timer* timer, void* arg);
+void hang_up(Client* c);
+void close_client(Client* client);
+void queue_empty_topic(Compactor* co, char* topic, ClientArray* a);
+void* compact_thread(void* arg);
+int compact_batch(Compactor* co);
+void free_client(Client* c);
+long topic_bytes(ClientArray* a, char* topic);
+long subscription_bytes(char* topic);
+long group_bytes(FilterGroup* g);
+void account_bytes(Compactor* co, long delta);
 void print_err();
 void print_socket_err();
+void print_capture_err();
 
 /* int main(int argc, char *argv[])
 * -----------------------------------------------
@@ -114,57 +436,276 @@ void print_socket_err();
 * argc: count of number of commandline arguments
 * argv: the array of commandline arguments stored as strings
 *
+* Options (may appear anywhere on the commandline):
+*   --clientrate rate[:burst]  limit each client name to rate pubs/second
+*   --topicrate rate[:burst]   limit each topic to rate pubs/second
+*   --unix path                also listen on a unix domain socket
+*   --backend uring|sync       send to subscribers with batched io_uring
+*                              sends, or one write per subscriber (default)
+*   --idle seconds             disconnect clients that send nothing for
+*                              this long
+*   --heartbeat seconds        send each client a ":heartbeat" line this
+*                              often
+*   --capture path             record every line received from clients to
+*                              path, for replay with psreplay
+*   --cpus list                run only on the listed CPUs (eg "0-3,8"),
+*                              with each client's thread pinned to one of
+*                              them in turn
+*
 * Returns: 0 on successful termination
 * Errors: programs exits with code 1 if the input is invalid
+*                            code 3 if the capture file can't be created
 */
 int main(int argc, char* argv[]) {
     int fdServer, connections;
     char* portStr;
-    if (argc < 2 || argc > 3) {
+    ServerOptions options;
+    char* positional[argc];
+    int count = parse_options(argc, argv, &options, positional);
+    // A client that goes away must only fail the write to it, not kill the
+    // server; set before any thread is started so all of them inherit it
+    signal(SIGPIPE, SIG_IGN);
+    if (count < 1 || count > 2) {
         print_err();
     }
-    if (argv[1] && isdigit(argv[1][0])) {
-        connections = atoi(argv[1]);
+    if (isdigit(positional[0][0])) {
+        connections = atoi(positional[0]);
         if (connections < 0) {
             print_err();
         }
     } else {
         print_err();
     }
-    if (argc == 3) {
-        if (isdigit(argv[2][0])) {
-            int portNum = atoi(argv[2]);
+    if (count == 2) {
+        if (isdigit(positional[1][0])) {
+            int portNum = atoi(positional[1]);
             if (portNum < 1024 || portNum > 65535) {
                 if (portNum != 0) {
                     print_err();
                 }
             }
-            portStr = argv[2];
+            portStr = positional[1];
         } else {
             print_err();
         }
     } else {
         portStr = "0";
     }
+    // Before anything is allocated or any thread is started, so the server's
+    // shared state is placed near the chosen CPUs and its threads inherit them
+    if (options.cpuCount && !pin_thread(options.cpus, options.cpuCount)) {
+        print_err();
+    }
+    if (options.capturePath) {
+        options.capture = capture_create(options.capturePath, now_ns());
+        if (!options.capture) {
+            print_capture_err();
+        }
+    }
     const char* port = portStr;
     fdServer = open_listen(port, connections);
-    pthread_t thread;
+    int fdUnix = -1;
+    if (options.unixPath) {
+        fdUnix = open_unix_listen(options.unixPath, connections);
+    }
     sigset_t set; // Reference: man page of pthread_sigmask
     int s;
     sigemptyset(&set); // Handle SIGHUP
     sigaddset(&set, SIGHUP);
-    s = pthread_sigmask(SIG_BLOCK, &set, NULL);
-    if (s == 0) {
-        // SigArgs* sigArgs;
-        // sigArgs->set = &set;
-        // sigArgs->statistics = statistics;
-        s = pthread_create(&thread, NULL, &sig_thread, (void*) &set);
-        pthread_detach(thread);
+    if (options.capture) {
+        // So the end of the capture is written out when the server is stopped
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGTERM);
     }
-    process_connections(fdServer);
+    s = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    process_connections(fdServer, fdUnix, &options, (s == 0) ? &set : NULL);
     return 0;
 }
 
+/* int parse_options(int argc, char* argv[], ServerOptions* options,
+*         char** positional)
+* -----------------------------------------------
+* Separates the "--" options on the commandline from the positional
+* arguments
+*
+* argc: count of number of commandline arguments
+* argv: the array of commandline arguments stored as strings
+* options: populated with the parsed options
+* positional: populated with the remaining arguments, in order
+*
+* Returns: the number of positional arguments
+* Errors: program exits with code 1 if an option is invalid
+*/
+int parse_options(int argc, char* argv[], ServerOptions* options,
+        char** positional) {
+    memset(options, 0, sizeof(ServerOptions));
+    int count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            positional[count++] = argv[i];
+            continue;
+        }
+        if (i + 1 >= argc) {
+            print_err();
+        }
+        char* value = argv[++i];
+        if (strcmp(argv[i - 1], "--clientrate") == 0) {
+            if (!parse_rate(value, &options->clientRate,
+                    &options->clientBurst)) {
+                print_err();
+            }
+        } else if (strcmp(argv[i - 1], "--topicrate") == 0) {
+            if (!parse_rate(value, &options->topicRate,
+                    &options->topicBurst)) {
+                print_err();
+            }
+        } else if (strcmp(argv[i - 1], "--unix") == 0) {
+            if (strlen(value) == 0
+                    || strlen(value) >= sizeof(((struct sockaddr_un*) 0)
+                    ->sun_path)) {
+                print_err();
+            }
+            options->unixPath = value;
+        } else if (strcmp(argv[i - 1], "--backend") == 0) {
+            if (strcmp(value, "uring") == 0) {
+                options->useUring = true;
+            } else if (strcmp(value, "sync") != 0) {
+                print_err();
+            }
+        } else if (strcmp(argv[i - 1], "--idle") == 0) {
+            if ((options->idleSecs = parse_seconds(value)) <= 0) {
+                print_err();
+            }
+        } else if (strcmp(argv[i - 1], "--heartbeat") == 0) {
+            if ((options->heartbeatSecs = parse_seconds(value)) <= 0) {
+                print_err();
+            }
+        } else if (strcmp(argv[i - 1], "--capture") == 0) {
+            options->capturePath = value;
+        } else if (strcmp(argv[i - 1], "--cpus") == 0) {
+            if (!(options->cpuCount = parse_cpus(value, &options->cpus))) {
+                print_err();
+            }
+        } else {
+            print_err();
+        }
+    }
+    return count;
+}
+
+/* int parse_rate(char* s, int* rate, int* burst)
+* -----------------------------------------------
+* Parses a rate limit of the form "rate[:burst]". The burst defaults to one
+* second's worth of messages.
+*
+* s: the string to be parsed
+* rate: set to the number of messages per second
+* burst: set to the number of messages that may be sent at once
+*
+* Returns: 1 if s is a valid rate limit, 0 otherwise
+*/
+int parse_rate(char* s, int* rate, int* burst) {
+    char* end;
+    long value = strtol(s, &end, 10);
+    if (!isdigit(s[0]) || value <= 0 || value > 1000000000) {
+        return 0;
+    }
+    *rate = *burst = (int) value;
+    if (*end == ':') {
+        char* burstStr = end + 1;
+        value = strtol(burstStr, &end, 10);
+        if (!isdigit(burstStr[0]) || value <= 0 || value > 1000000000) {
+            return 0;
+        }
+        *burst = (int) value;
+    }
+    return *end == '\0';
+}
+
+/* int parse_seconds(char* s)
+* -----------------------------------------------
+* Parses a whole number of seconds given as an option value
+*
+* s: the value
+*
+* Returns: the number of seconds, or -1 if s is not a number
+*/
+int parse_seconds(char* s) {
+    char* end;
+    if (!isdigit(s[0])) {
+        return -1;
+    }
+    long secs = strtol(s, &end, 10);
+    return (*end == '\0' && secs <= INT32_MAX) ? secs : -1;
+}
+
+/* int parse_cpus(char* s, int** cpus)
+* -----------------------------------------------
+* Parses a list of CPUs of the form "cpu[-cpu][,...]", eg "0-3,8". Every CPU
+* must be one the server is allowed to run on.
+*
+* s: the list
+* cpus: set to the CPUs listed, in order
+*
+* Returns: the number of CPUs listed, or 0 if s is invalid
+*/
+int parse_cpus(char* s, int** cpus) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed)) {
+        return 0;
+    }
+    int count = 0;
+    *cpus = malloc(sizeof(int) * CPU_SETSIZE);
+    char* end;
+    while (1) {
+        if (!isdigit(s[0])) {
+            return 0;
+        }
+        long first = strtol(s, &end, 10);
+        long last = first;
+        if (*end == '-') {
+            if (!isdigit(end[1])) {
+                return 0;
+            }
+            last = strtol(end + 1, &end, 10);
+        }
+        if (last < first || last >= CPU_SETSIZE) {
+            return 0;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (!CPU_ISSET(cpu, &allowed) || count == CPU_SETSIZE) {
+                return 0;
+            }
+            (*cpus)[count++] = cpu;
+        }
+        if (*end != ',') {
+            break;
+        }
+        s = end + 1;
+    }
+    return (*end == '\0') ? count : 0;
+}
+
+/* bool pin_thread(int* cpus, int count)
+* -----------------------------------------------
+* Restricts the calling thread to a set of CPUs. Threads it creates
+* afterwards inherit the set.
+*
+* cpus: the CPUs
+* count: number of CPUs
+*
+* Returns: true on success, false if the thread couldn't be restricted
+*/
+bool pin_thread(int* cpus, int count) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < count; i++) {
+        CPU_SET(cpus[i], &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set)
+            == 0;
+}
+
 /* int open_listen(const char* port, int connections)
 * -----------------------------------------------
 * Listens on given port. Returns listening socket (or exits on failure)
@@ -213,46 +754,138 @@ int open_listen(const char* port, int connections) {
         perror("sockname");
         return 4;
     }
-    fprintf(stderr, "%u\n", ntohs(ad.sin_port));
-    fflush(stderr);
     if (listen(listenfd, 10) < 0) {  // Up to 10 connection requests can queue
         perror("Listen");
         return 4;
     }
+    // Only printed once listening, so whoever reads it can connect at once
+    fprintf(stderr, "%u\n", ntohs(ad.sin_port));
+    fflush(stderr);
     freeaddrinfo(ai);
     // Have listening socket - return it
     return listenfd;
 }
 
-/* void process_connections(int fdServer)
+/* int open_unix_listen(const char* path, int connections)
+* -----------------------------------------------
+* Listens on a unix domain socket for clients on the same host. A stale
+* socket left at path is replaced, but anything else there is left alone.
+*
+* path: filesystem path of the socket
+* connections: maximum limit on number of connected clients
+*
+* Returns: the file descriptor of the opened socket
+* Errors: exit code 2 on failure to open socket, or if path exists and is
+*         not a socket
+*/
+int open_unix_listen(const char* path, int connections) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenfd < 0) {
+        print_socket_err();
+    }
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            print_socket_err();
+        }
+        unlink(path);
+    }
+    if (bind(listenfd, (struct sockaddr *)&addr,
+            sizeof(struct sockaddr_un)) < 0 || listen(listenfd, 10) < 0) {
+        print_socket_err();
+    }
+    return listenfd;
+}
+
+/* void process_connections(int fdServer, int fdUnix, ServerOptions* options,
+*         sigset_t* set)
 * -----------------------------------------------
 * Processes incoming client connections and spawns a new thread for each client
 *
 * fdServer: file descriptor of the listening socket
+* fdUnix: file descriptor of the unix domain listening socket, or -1
+* options: the server's startup options
+* set: signals to report statistics on, NULL if they couldn't be blocked
 *
 * Errors: exits with code 1 on failure to accept a new connection
 */
-void process_connections(int fdServer) {
+void process_connections(int fdServer, int fdUnix, ServerOptions* options,
+        sigset_t* set) {
     int fd;
-    struct sockaddr_in fromAddr;
+    struct sockaddr_storage fromAddr;
     socklen_t fromAddrSize;
     int clientCount = 0;
     int statistics[5] = {0};
     StringMap* sm = stringmap_init();
     sem_t l;
     init_lock(&l);
+    Limits limits;
+    init_rate_limiter(&limits.client, options->clientRate,
+            options->clientBurst);
+    init_rate_limiter(&limits.topic, options->topicRate, options->topicBurst);
+    FanoutRing fanout; // Only used with the guard held
+    fanout_init(&fanout, options->useUring);
+    TimerService timers;
+    timer_wheel_init(&timers.wheel, TIMER_TICK_NS, now_ns());
+    timer_wheel_init(&timers.idleWheel, TIMER_TICK_NS, now_ns());
+    pthread_mutex_init(&timers.idleLock, NULL);
+    timers.guard = &l;
+    sem_init(&timers.wake, 0, 0);
+    timers.wakeAt = UINT64_MAX;
+    timers.idleNs = options->idleSecs * 1000000000ULL;
+    timers.heartbeatNs = options->heartbeatSecs * 1000000000ULL;
+    pthread_t timerThread;
+    pthread_create(&timerThread, NULL, timer_thread, &timers);
+    pthread_detach(timerThread);
+    Compactor compactor;
+    init_client_array(&compactor.dead, 1);
+    compactor.empty = stringmap_init();
+    compactor.sm = sm;
+    compactor.guard = &l;
+    sem_init(&compactor.wake, 0, 0);
+    memset(&compactor.gauges, 0, sizeof(Gauges));
+    pthread_t compacter;
+    pthread_create(&compacter, NULL, compact_thread, &compactor);
+    pthread_detach(compacter);
+    SigArgs sigArgs = {.set = set, .statistics = statistics,
+            .compactor = &compactor, .fanout = &fanout, .guard = &l,
+            .capture = options->capture};
+    if (set) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, &sig_thread, &sigArgs);
+        pthread_detach(thread);
+    }
+    struct pollfd listeners[2] = {
+        {.fd = fdServer, .events = POLLIN},
+        {.fd = fdUnix, .events = POLLIN} // Ignored by poll() if -1
+    };
     while (1) { // Repeatedly accept connections
-        fromAddrSize = sizeof(struct sockaddr_in);
-        fd = accept(fdServer, (struct sockaddr *)&fromAddr, &fromAddrSize);
+        if (poll(listeners, 2, -1) < 0) {
+            continue;
+        }
+        bool local = !(listeners[0].revents & POLLIN);
+        fromAddrSize = sizeof(struct sockaddr_storage);
+        fd = accept(local ? fdUnix : fdServer, (struct sockaddr *)&fromAddr,
+                &fromAddrSize);
         if (fd < 0) {
             print_socket_err();
         }
-        char hostname[NI_MAXHOST];
-        int err = getnameinfo((struct sockaddr *)&fromAddr,
-                            fromAddrSize, hostname, NI_MAXHOST, NULL, 0, 0);
-        if (err) {
-            print_socket_err();
-        } 
+        if (!local) {
+            char hostname[NI_MAXHOST];
+            int err = getnameinfo((struct sockaddr *)&fromAddr,
+                    fromAddrSize, hostname, NI_MAXHOST, NULL, 0, 0);
+            if (err) {
+                print_socket_err();
+            }
+        }
+        // Bounds how long a client that stops reading can hold the guard
+        struct timeval timeout = {.tv_sec = SEND_TIMEOUT_MS / 1000,
+                .tv_usec = SEND_TIMEOUT_MS % 1000 * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
         int fd2 = dup(fd);
         int fd1 = dup(fd);
         FILE* readClient = fdopen(fd1, "r");
@@ -262,11 +895,51 @@ void process_connections(int fdServer) {
         Client* client = malloc(sizeof(Client));
         client->statistics = statistics;
         client->id = clientCount;
+        client->fd = fd;
         client->fileRead = readClient;
         client->fileWrite = writeClient;
         client->active = true;
+        client->hungUp = false;
+        client->name = NULL;
         client->sm = sm;
         client->guard = &l;
+        client->limits = &limits;
+        client->fanout = &fanout;
+        client->timers = &timers;
+        client->coalesceBytes = 0;
+        client->outBuf = NULL;
+        client->outLen = 0;
+        client->inSize = INPUT_BUFFER;
+        client->inBuf = NULL; // Allocated by the client's thread
+        client->inStart = client->inEnd = 0;
+        client->local = local;
+        client->shm = NULL;
+        client->subs = stringmap_init();
+        client->compactor = &compactor;
+        client->lastInput = now_ns();
+        client->capture = options->capture;
+        client->cpu = options->cpuCount
+                ? options->cpus[(clientCount - 1) % options->cpuCount] : -1;
+        if (client->capture) {
+            capture_record(client->capture, client->lastInput, client->id,
+                    CAPTURE_OPEN, NULL, 0);
+        }
+        timer_init(&client->flushTimer, flush_expired, client);
+        timer_init(&client->idleTimer, idle_expired, client);
+        timer_init(&client->heartbeatTimer, heartbeat_expired, client);
+        take_lock(&l);
+        statistics[0]++;
+        compactor.gauges.clients++;
+        account_bytes(&compactor, sizeof(Client) + client->inSize + 1);
+        if (timers.idleNs) {
+            arm_idle_timer(&timers, &client->idleTimer,
+                    client->lastInput + timers.idleNs);
+        }
+        if (timers.heartbeatNs) {
+            arm_timer(&timers, &client->heartbeatTimer,
+                    client->lastInput + timers.heartbeatNs);
+        }
+        release_lock(&l);
         args->clientCount = clientCount;
         args->client = client;
         pthread_create(&(client->threadId), NULL, client_thread, args);
@@ -284,222 +957,1305 @@ void process_connections(int fdServer) {
 void* client_thread(void* arg) {
     Args* args = arg;
     Client* client = args->client;
-    take_lock(client->guard);
-    FILE* fileRead = client->fileRead;
-    FILE* fileWrite = client->fileWrite;
-    StringMap* sm = client->sm;
-    int id = (int)client->id;
     free(arg);
     char* clientLine;
-    fflush(fileWrite);
-    while ((clientLine = read_line(fileRead))) {
-        if (clientLine == NULL) {
+    size_t len;
+    DelimScan scan;
+    Command cmd;
+    if (client->cpu >= 0) {
+        pin_thread(&client->cpu, 1);
+    }
+    // Allocated once pinned so the pages are first touched, and so placed,
+    // on the node of the CPU that uses them
+    client->inBuf = malloc(client->inSize + 1);
+    fflush(client->fileWrite);
+    while ((clientLine = read_frame(client, &scan, &len))) {
+        parse_command(clientLine, len, &scan, &cmd);
+        if (strcmp(cmd.name, "mpub") == 0) {
+            // Payload lines are read before the lock is taken so that a slow
+            // producer never stalls the other clients
+            if (!handle_mpub(client, &cmd)) {
+                break;
+            }
             continue;
         }
-        char** inputSplit = split_by_char(clientLine, ' ', 2);
-        if (strcmp(inputSplit[0], "name") == 0) {
-            if (inputSplit[1] && strlen(inputSplit[1]) != 0
-                    && is_valid_string(inputSplit[1])) {
-                if (client->name == NULL) {
-                    client->name = strdup(inputSplit[1]);
-                }
-            } else {
-                fprintf(fileWrite, ":invalid\n");
-                fflush(fileWrite);
-            }
-        } else if (strcmp(inputSplit[0], "sub") == 0) {
-            if (client->name == NULL) {
-                continue;
-            }
-            void* item;
-            if (!(item = stringmap_search(sm, inputSplit[1]))) {
-                ClientArray* a = malloc(sizeof(ClientArray));
-                init_client_array(a, 1);
-                insert_client_array(a, client);
-                stringmap_add(sm, inputSplit[1], a);
-            } else {
-                ClientArray* a = (ClientArray *) item;
-                bool dupFlag = 0;
-                for (int i = 0; i < a->count; i++) {
-                    Client* c = a->client[i];
-                    if (c) {
-                        if ((c->id == client->id)) {
-                            dupFlag = 1; // Already subbed
-                            break;
-                        }
-                    } 
-                }
-                if (!dupFlag) {
-                    stringmap_remove(sm, inputSplit[1]);
-                    insert_client_array(a, client);
-                    stringmap_add(sm, inputSplit[1], a);
-                }
-            }
-        } else if (strcmp(inputSplit[0], "pub") == 0) {
-            if (!inputSplit[1] || strlen(inputSplit[1]) == 0) {
-                fprintf(fileWrite, ":invalid\n");
-                fflush(fileWrite);
-                continue;
-            }
-            if (client->name == NULL) {
-                continue;
-            }
-            char** pubSplit = split_by_char(inputSplit[1], ' ', 2);
-            if (!pubSplit[1] || strlen(pubSplit[1]) == 0) {
-                fprintf(fileWrite, ":invalid\n");
-                fflush(fileWrite);
-                continue;
-            }
-            void* item;
-            if (!(item = stringmap_search(sm, pubSplit[0]))) {
-                // ERROR retrieving pubSplit[0]
-            } else {
-                if (!item) {
-                    //    ERROR: Empty array
-                } else {
-                    ClientArray* a = (ClientArray *) item;
-                    for (int i = 0; i < a->count; i++) {
-                        Client* c = a->client[i];
-                        if (client != NULL) {
-                            fprintf(c->fileWrite, "%s:%s:%s\n", client->name,
-                                    pubSplit[0], pubSplit[1]);
-                            fflush(c->fileWrite);
-                        }
-                    }
-                }
-            }
-            free(pubSplit);
-        } else if (strcmp(inputSplit[0], "unsub") == 0) {
-            if (client->name == NULL) {
-                continue;
-            }
-            void* item;
-            if (!(item = stringmap_search(sm, inputSplit[1]))) {
-                //      ERROR retrieving inputSplit[1]
-            } else {
-                ClientArray* a = (ClientArray *) item;
-                bool flag = 0;
-                for (int i = 0; i < a->count; i++) {
-                    Client* client = a->client[i];
-                    if (client->id == id) {
-                        delete_client(a, client);
-                        flag = 1;
-                        break;
-                    }
-                }
-                if (flag) {
-                    stringmap_remove(sm, inputSplit[1]);
-                    stringmap_add(sm, inputSplit[1], a);
-                }
-            }
+        if (strcmp(cmd.name, "pub") == 0) {
+            // Takes the guard itself, after the rate limits are checked
+            handle_pub(client, &cmd);
+            continue;
+        }
+        if (strcmp(cmd.name, "heartbeat") == 0) {
+            continue; // Reply to a heartbeat, only needed to count as input
+        }
+        take_lock(client->guard);
+        if (strcmp(cmd.name, "shm") == 0) {
+            handle_shm(client);
+        } else if (strcmp(cmd.name, "name") == 0) {
+            handle_name(client, &cmd);
+        } else if (strcmp(cmd.name, "sub") == 0) {
+            handle_sub(client, &cmd);
+        } else if (strcmp(cmd.name, "unsub") == 0) {
+            handle_unsub(client, cmd.args);
+        } else if (strcmp(cmd.name, "coalesce") == 0) {
+            handle_coalesce(client, cmd.args);
         } else {
-            fprintf(fileWrite, ":invalid\n");
-            fflush(fileWrite);
+            send_invalid(client);
         }
         release_lock(client->guard);
-        free(inputSplit);
-        free(clientLine);
-    }
-    StringMapItem* smi = NULL;
-    smi = stringmap_iterate(sm, smi);
-    if (!smi) {
-        stringmap_free(sm);
     }
-    fclose(fileRead);
-    fclose(fileWrite);
+    take_lock(client->guard);
+    close_client(client);
+    release_lock(client->guard);
     return NULL;
 }
 
-/* void init_client_array(ClientArray* a, size_t initialSize)
+/* char* read_frame(Client* c, DelimScan* scan, size_t* len)
 * -----------------------------------------------
-* Initializes a new ClientArray 
-* 
-* a: the ClientArray to be initialized
-* initialSize: required initial size of array
+* Reads the next line sent by the client into its input buffer. The line
+* is found, and its spaces and colons located, in a single pass with
+* delim_scan(); bytes already scanned are not scanned again when more input
+* is needed. A final line without a newline is still returned. Lines are
+* recorded to the capture file, if there is one.
+*
+* c: the client to read from
+* scan: set to the delimiters found in the line
+* len: set to the length of the line
+*
+* Returns: the line, with its newline replaced by a null terminator (valid
+*          until the next call), or NULL at end of file
 */
-void init_client_array(ClientArray* a, size_t initialSize) {
-    a->client = malloc(initialSize * sizeof(Client*));
-    a->used = 0;
-    a->size = initialSize;
-    a->count = 0;
+char* read_frame(Client* c, DelimScan* scan, size_t* len) {
+    delim_scan_init(scan);
+    size_t scanned = 0;
+    while (1) {
+        char* line = c->inBuf + c->inStart;
+        size_t avail = c->inEnd - c->inStart;
+        size_t end = delim_scan(line, scanned, avail, scan);
+        if (end < avail) {
+            line[end] = '\0';
+            *len = end;
+            c->inStart += end + 1;
+            if (c->capture) {
+                capture_record(c->capture, now_ns(), c->id, CAPTURE_LINE,
+                        line, end);
+            }
+            return line;
+        }
+        scanned = avail;
+        memmove(c->inBuf, line, avail);
+        c->inStart = 0;
+        c->inEnd = avail;
+        if (c->inEnd == c->inSize) {
+            account_bytes(c->compactor, c->inSize);
+            c->inSize *= 2;
+            c->inBuf = realloc(c->inBuf, c->inSize + 1);
+        }
+        ssize_t n = read_input(c, c->inBuf + c->inEnd, c->inSize - c->inEnd);
+        if (n <= 0) {
+            if (avail == 0) {
+                return NULL;
+            }
+            c->inBuf[avail] = '\0';
+            *len = avail;
+            c->inStart = c->inEnd;
+            if (c->capture) {
+                capture_record(c->capture, now_ns(), c->id, CAPTURE_LINE,
+                        c->inBuf, avail);
+            }
+            return c->inBuf;
+        }
+        c->inEnd += n;
+    }
 }
 
-/* int insert_client_array(ClientArray* a, Client* element)
+/* ssize_t read_input(Client* c, char* buf, size_t len)
 * -----------------------------------------------
-* Inserts a client into ClientArray
-* 
-* a: the ClientArray to be initialized
-* initialSize: required initial size of array
+* Reads whatever the client has sent, up to len bytes, blocking if nothing
+* is available, and notes the time for the idle timeout
 *
-* Returns: 0, on insertion error
-*          1, on successful insertion
+* c: the client to read from
+* buf: buffer to read into
+* len: size of buf
+*
+* Returns: number of bytes read, 0 at end of file or -1 on error
 */
-int insert_client_array(ClientArray* a, Client* element) {
-    for (int i = 0; i < a->count; i++) {
-        if (a->client[i] == element) {
-            // ERROR: Already in array!
-            return 0;
-        }
-        if (a->client[i]->id == element->id) {
-            // ERROR: Already in array!
-            return 0;
+ssize_t read_input(Client* c, char* buf, size_t len) {
+    ssize_t n;
+    if (c->shm) {
+        n = shm_link_read(c->shm, buf, len);
+    } else {
+        while ((n = read(fileno(c->fileRead), buf, len)) < 0
+                && errno == EINTR) {
         }
     }
-    if (a->used == a->size) {
-        a->size *= 2;
-        a->client = (Client**) realloc(a->client, a->size * sizeof(Client*));
+    if (n > 0 && c->timers->idleNs) {
+        // Read by the idle timer, which is moved back rather than reset here
+        __atomic_store_n(&c->lastInput, now_ns(), __ATOMIC_RELAXED);
     }
-    a->client[a->used++] = element;
-    a->count++;
-    return 1;
+    return n;
 }
 
-/* void remove_client(ClientArray* a, int index)
+/* void parse_command(char* line, size_t len, DelimScan* scan, Command* cmd)
 * -----------------------------------------------
-* Removes a client at a particular index
-* 
-* a: the ClientArray from which client is to be removed
-* index: index of client that is to be removed
+* Splits a line into its command and arguments using the delimiters already
+* found by read_frame(), so the line is not scanned again
+*
+* line: the line (the first space is replaced by a null terminator)
+* len: length of line
+* scan: the delimiters in line
+* cmd: populated with the parts of the line
 */
-void remove_client(ClientArray* a, int index) {
-    if (index < 0 || index >= a->count) {
+void parse_command(char* line, size_t len, DelimScan* scan, Command* cmd) {
+    cmd->name = line;
+    cmd->args = cmd->rest = NULL;
+    cmd->restLen = 0;
+    cmd->argsValid = false;
+    if (scan->space[0] == DELIM_NONE) {
         return;
     }
-    for (int i = index; i < a->count - 1; i++) {
-        a->client[i] = a->client[i + 1];
+    line[scan->space[0]] = '\0';
+    cmd->args = line + scan->space[0] + 1;
+    // A colon before the first space is in the command name, which makes
+    // the whole command invalid anyway
+    cmd->argsValid = scan->space[0] + 1 < len
+            && scan->space[1] == DELIM_NONE
+            && (scan->colon == DELIM_NONE || scan->colon < scan->space[0]);
+    if (scan->space[1] != DELIM_NONE) {
+        cmd->rest = line + scan->space[1] + 1;
+        cmd->restLen = len - scan->space[1] - 1;
     }
-    a->count--;
 }
 
-/* void delete_client(ClientArray* a, Client* element)
+/* void send_invalid(Client* client)
 * -----------------------------------------------
-* Deletes a client from a ClientArray
-* 
-* a: the ClientArray from which element is to be removed
-* element: the client that is to be removed
+* Replies to the client that its last command was invalid, unless it has
+* been hung up
+*
+* client: the client that sent the invalid command
 */
-void delete_client(ClientArray* a, Client* element) {
-    for (int i = 0; i < a->count; i++) {
-        if (a->client[i] == element) {
-            remove_client(a, i);
-            return;
-        }
+void send_invalid(Client* client) {
+    if (__atomic_load_n(&client->hungUp, __ATOMIC_RELAXED)) {
+        return;
     }
+    fprintf(client->fileWrite, ":invalid\n");
+    fflush(client->fileWrite);
 }
 
-/* void print_client_array(ClientArray* a, StringMap* sm)
+/* void send_reply_locked(Client* client, const char* reply)
 * -----------------------------------------------
-* Prints out the elements of Client Array as well as StringMap
-* 
-* a: the ClientArray to be printed
-* sm: the StringMap to be printed
+* Sends a reply to the client from outside the guard. The guard is taken for
+* the write, since other threads send messages straight to the client's
+* socket with it held, and a send that blocks part way through lets another
+* write on the socket in. Nothing is sent to a client that has been hung up.
+*
+* client: the client to reply to
+* reply: the reply, including its newline
 */
-void print_client_array(ClientArray* a, StringMap* sm) {
-    printf("[");
-    for (int i = 0; i < a->count; i++) {
-        if (a->client[i] != NULL) {
-            printf(" %d ", a->client[i]->id);
-        }
+void send_reply_locked(Client* client, const char* reply) {
+    take_lock(client->guard);
+    if (!__atomic_load_n(&client->hungUp, __ATOMIC_RELAXED)) {
+        fputs(reply, client->fileWrite);
+        fflush(client->fileWrite);
+    }
+    release_lock(client->guard);
+}
+
+/* void handle_shm(Client* client)
+* -----------------------------------------------
+* Handles the "shm" command, moving a unix domain socket client onto a
+* shared memory link. Only valid as the first command on the connection,
+* since nothing else may hold the client's streams yet. On success the link
+* is sent instead of a reply and the socket is only kept to detect the
+* client going away.
+*
+* client: the client that sent the command
+*/
+void handle_shm(Client* client) {
+    if (!client->local || client->shm || client->name) {
+        send_invalid(client);
+        return;
+    }
+    int sock = dup(fileno(client->fileWrite));
+    ShmLink* link = shm_link_create(sock);
+    if (!link) {
+        close(sock);
+        send_invalid(client);
+        return;
+    }
+    FILE* fileRead = shm_link_fopen(link, "r");
+    FILE* fileWrite = shm_link_fopen(link, "w");
+    fclose(client->fileRead);
+    fclose(client->fileWrite);
+    link->writeTimeoutMs = SEND_TIMEOUT_MS;
+    client->fileRead = fileRead;
+    client->fileWrite = fileWrite;
+    client->shm = link;
+}
+
+/* void handle_name(Client* client, Command* cmd)
+* -----------------------------------------------
+* Handles the "name" command. A client can only be named once.
+*
+* client: the client that sent the command
+* cmd: the command, whose args are the requested name
+*/
+void handle_name(Client* client, Command* cmd) {
+    if (cmd->argsValid) {
+        if (client->name == NULL) {
+            client->name = strdup(cmd->args);
+        }
+    } else {
+        send_invalid(client);
+    }
+}
+
+/* char* command_topic(Command* cmd)
+* -----------------------------------------------
+* Gets the topic from a "sub" command, which is the first argument
+*
+* cmd: the command (args is ended at the second space)
+*
+* Returns: the topic, or NULL if there is none
+*/
+char* command_topic(Command* cmd) {
+    if (cmd->rest) {
+        cmd->rest[-1] = '\0';
+    }
+    return (cmd->args && strlen(cmd->args) > 0) ? cmd->args : NULL;
+}
+
+/* void handle_sub(Client* client, Command* cmd)
+* -----------------------------------------------
+* Handles the "sub topic" and "sub topic filter expr" commands, adding the
+* client to the topic's subscribers. With a filter (see filter_compile()),
+* the client is only sent messages whose payload matches it, and is grouped
+* with the topic's other subscribers with the same filter. Any other text
+* after the topic is invalid. A client that is already subscribed to the
+* topic stays subscribed as it was. Must be called with the guard held.
+*
+* client: the client that sent the command
+* cmd: the command
+*/
+void handle_sub(Client* client, Command* cmd) {
+    StringMap* sm = client->sm;
+    Compactor* co = client->compactor;
+    char* topic = command_topic(cmd);
+    if (client->name == NULL || topic == NULL) {
+        return;
+    }
+    Filter filter;
+    bool filtered = false;
+    if (cmd->rest) {
+        if (strncmp(cmd->rest, "filter ", 7) != 0
+                || !filter_compile(&filter, cmd->rest + 7)) {
+            send_invalid(client);
+            return;
+        }
+        filtered = true;
+    }
+    client->statistics[3]++;
+    ClientArray* a = stringmap_search(sm, topic);
+    if (!a) {
+        a = malloc(sizeof(ClientArray));
+        init_client_array(a, 1);
+        stringmap_add(sm, topic, a);
+        co->gauges.topics++;
+        account_bytes(co, topic_bytes(a, topic));
+    } else if (is_subscribed(a, client)) {
+        if (filtered) {
+            filter_free(&filter);
+        }
+        return;
+    }
+    if (filtered) {
+        add_filtered(a, client, &filter);
+    } else {
+        size_t size = a->size;
+        stringmap_remove(sm, topic);
+        insert_client_array(a, client);
+        stringmap_add(sm, topic, a);
+        account_bytes(co, (long) (a->size - size) * sizeof(Client*));
+    }
+    stringmap_add(client->subs, topic, a);
+    co->gauges.subscriptions++;
+    account_bytes(co, subscription_bytes(topic));
+}
+
+/* void handle_pub(Client* client, Command* cmd)
+* -----------------------------------------------
+* Handles the "pub" command, sending the message to every subscriber of the
+* topic. The rate limits are checked before the guard is taken, so a
+* throttled publisher never contends for it.
+*
+* client: the client that sent the command
+* cmd: the command, whose args are "topic value"
+*/
+void handle_pub(Client* client, Command* cmd) {
+    if (!cmd->args || strlen(cmd->args) == 0) {
+        send_reply_locked(client, ":invalid\n");
+        return;
+    }
+    if (client->name == NULL) {
+        return;
+    }
+    if (!cmd->rest || cmd->restLen == 0) {
+        send_reply_locked(client, ":invalid\n");
+        return;
+    }
+    char* topic = cmd->args;
+    cmd->rest[-1] = '\0'; // End the topic at the second space
+    if (check_limits(client, topic, 1)) {
+        take_lock(client->guard);
+        publish(client, topic, &cmd->rest, &cmd->restLen, 1);
+        release_lock(client->guard);
+    }
+}
+
+/* void handle_unsub(Client* client, char* topic)
+* -----------------------------------------------
+* Handles the "unsub" command, removing the client from the topic's
+* subscribers. A topic left without subscribers is handed to the compactor.
+* Must be called with the guard held.
+*
+* client: the client that sent the command
+* topic: the topic to unsubscribe from
+*/
+void handle_unsub(Client* client, char* topic) {
+    StringMap* sm = client->sm;
+    Compactor* co = client->compactor;
+    if (client->name == NULL || topic == NULL) {
+        return;
+    }
+    client->statistics[4]++;
+    void* item;
+    if (!(item = stringmap_search(sm, topic))) {
+        //      ERROR retrieving topic
+    } else {
+        ClientArray* a = (ClientArray *) item;
+        if (unsubscribe(a, client)) {
+            stringmap_remove(sm, topic);
+            stringmap_add(sm, topic, a);
+            stringmap_remove(client->subs, topic);
+            co->gauges.subscriptions--;
+            account_bytes(co, -subscription_bytes(topic));
+            if (topic_empty(a)) {
+                queue_empty_topic(co, topic, a);
+            }
+        }
+    }
+}
+
+/* int handle_mpub(Client* client, char* args)
+* -----------------------------------------------
+* Handles the "mpub topic count" command. The next count lines sent by the
+* client are the payloads of the batch. All payloads are read before the
+* guard is taken, then the topic is looked up once and the whole batch is
+* handed to each subscriber in a single write. A batch containing an empty
+* payload is rejected as a whole, and every message in the batch counts
+* against the rate limits.
+*
+* client: the client that sent the command
+* cmd: the command, whose args are "topic count"
+*
+* Returns: 0, if the connection closed part way through the batch
+*          1, otherwise
+*/
+int handle_mpub(Client* client, Command* cmd) {
+    if (!cmd->args || strlen(cmd->args) == 0) {
+        send_reply_locked(client, ":invalid\n");
+        return 1;
+    }
+    int count = parse_batch_count(cmd->rest);
+    if (count <= 0 || cmd->rest == cmd->args + 1) {
+        send_reply_locked(client, ":invalid\n");
+        return 1;
+    }
+    // The input buffer is reused for the payloads, so keep a copy of topic
+    cmd->rest[-1] = '\0';
+    char* topic = strdup(cmd->args);
+    char** payloads = malloc(sizeof(char*) * count);
+    size_t* lengths = malloc(sizeof(size_t) * count);
+    int read = 0;
+    bool valid = true;
+    DelimScan scan;
+    while (read < count) {
+        size_t len;
+        char* line = read_frame(client, &scan, &len);
+        if (line == NULL) {
+            break;
+        }
+        if (len == 0) {
+            valid = false;
+        }
+        payloads[read] = malloc(len + 1);
+        memcpy(payloads[read], line, len + 1);
+        lengths[read++] = len;
+    }
+    int status = (read == count);
+    if (status && !valid) {
+        send_reply_locked(client, ":invalid\n");
+    } else if (status && client->name != NULL
+            && check_limits(client, topic, count)) {
+        take_lock(client->guard);
+        publish(client, topic, payloads, lengths, count);
+        release_lock(client->guard);
+    }
+    for (int i = 0; i < read; i++) {
+        free(payloads[i]);
+    }
+    free(payloads);
+    free(lengths);
+    free(topic);
+    return status;
+}
+
+/* int check_limits(Client* client, char* topic, int count)
+* -----------------------------------------------
+* Checks whether the client may publish count messages to the topic, and
+* replies ":throttled" if not. The guard is only taken for the reply.
+*
+* client: the publishing client (must be named)
+* topic: the topic being published to
+* count: number of messages being published
+*
+* Returns: 1 if the messages may be published, 0 if they are throttled
+*/
+int check_limits(Client* client, char* topic, int count) {
+    Limits* limits = client->limits;
+    if (rate_allow(&limits->client, client->name, count)
+            && rate_allow(&limits->topic, topic, count)) {
+        return 1;
+    }
+    send_reply_locked(client, ":throttled\n");
+    return 0;
+}
+
+/* int parse_batch_count(char* s)
+* -----------------------------------------------
+* Parses the message count of an mpub command
+*
+* s: the count as a string (may be NULL)
+*
+* Returns: the count, or 0 if it is not a number between 1 and MAX_BATCH
+*/
+int parse_batch_count(char* s) {
+    if (s == NULL || strlen(s) == 0 || strlen(s) > 9) {
+        return 0;
+    }
+    for (int i = 0; s[i]; i++) {
+        if (!isdigit(s[i])) {
+            return 0;
+        }
+    }
+    int count = atoi(s);
+    return (count > MAX_BATCH) ? 0 : count;
+}
+
+/* void publish(Client* client, char* topic, char** payloads, size_t* lengths,
+*         int count)
+* -----------------------------------------------
+* Formats one or more messages from the client and delivers them to every
+* subscriber of the topic. The topic is looked up once and the messages are
+* formatted once into a single buffer that is shared by all subscribers, and
+* the socket subscribers are all sent it in one batch. Each filter on the
+* topic is run once per message, and its group of subscribers is sent only
+* the messages that match (sharing the buffer if they all do). Must be
+* called with the guard held.
+*
+* client: the publishing client
+* topic: the topic being published to
+* payloads: the message payloads
+* lengths: length of each payload
+* count: number of payloads
+*/
+void publish(Client* client, char* topic, char** payloads, size_t* lengths,
+        int count) {
+    void* item;
+    client->statistics[2] += count;
+    if (!(item = stringmap_search(client->sm, topic))) {
+        return; // No subscribers
+    }
+    ClientArray* a = (ClientArray *) item;
+    if (topic_empty(a)) {
+        return;
+    }
+    size_t nameLen = strlen(client->name);
+    size_t topicLen = strlen(topic);
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        len += nameLen + topicLen + lengths[i] + 3;
+    }
+    // Each message is "name:topic:payload\n"
+    char* buf = malloc(len);
+    char* p = buf;
+    for (int i = 0; i < count; i++) {
+        memcpy(p, client->name, nameLen);
+        p += nameLen;
+        *p++ = ':';
+        memcpy(p, topic, topicLen);
+        p += topicLen;
+        *p++ = ':';
+        memcpy(p, payloads[i], lengths[i]);
+        p += lengths[i];
+        *p++ = '\n';
+    }
+    fan_out(client, a, buf, len);
+    char* matched = a->groups ? malloc(len) : NULL;
+    for (FilterGroup* g = a->groups; g; g = g->next) {
+        size_t matchedLen = 0;
+        p = buf;
+        for (int i = 0; i < count; i++) {
+            size_t msgLen = nameLen + topicLen + lengths[i] + 3;
+            if (filter_match(&g->filter, payloads[i], lengths[i])) {
+                memcpy(matched + matchedLen, p, msgLen);
+                matchedLen += msgLen;
+            }
+            p += msgLen;
+        }
+        if (matchedLen == len) {
+            fan_out(client, &g->members, buf, len);
+        } else if (matchedLen > 0) {
+            fan_out(client, &g->members, matched, matchedLen);
+        }
+    }
+    free(matched);
+    free(buf);
+}
+
+/* void fan_out(Client* client, ClientArray* subs, const char* buf,
+*         size_t len)
+* -----------------------------------------------
+* Delivers formatted messages to a list of subscribers. The socket
+* subscribers are all sent them in one batch, subscribers that have
+* coalescing enabled buffer them instead, and subscribers that have
+* disconnected but not yet been reclaimed are skipped. Must be called with
+* the guard held.
+*
+* client: the publishing client
+* subs: the subscribers
+* buf: the formatted messages
+* len: length of buf in bytes
+*/
+void fan_out(Client* client, ClientArray* subs, const char* buf, size_t len) {
+    if (subs->count == 0) {
+        return;
+    }
+    int* fds = malloc(sizeof(int) * subs->count);
+    int fdCount = 0;
+    for (int i = 0; i < subs->count; i++) {
+        Client* c = subs->client[i];
+        if (c == NULL || !c->active
+                || __atomic_load_n(&c->hungUp, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        if (c->coalesceBytes) {
+            buffer_output(c, buf, len);
+        } else if (c->shm) {
+            deliver(c, buf, len);
+        } else if (fflush(c->fileWrite) == EOF) {
+            // Earlier replies must go first, and couldn't be sent in time
+            hang_up(c);
+        } else {
+            fds[fdCount++] = fileno(c->fileWrite);
+        }
+    }
+    fanout_send(client->fanout, fds, fdCount, buf, len);
+    free(fds);
+}
+
+/* void deliver(Client* c, const char* buf, size_t len)
+* -----------------------------------------------
+* Sends a buffer of formatted messages to a shared memory subscriber. These
+* go through the subscriber's stream so its lock keeps the link to a single
+* writer. A subscriber that doesn't make room for them within the send
+* timeout is disconnected.
+*
+* c: the subscriber
+* buf: the formatted messages
+* len: length of buf in bytes
+*/
+void deliver(Client* c, const char* buf, size_t len) {
+    if (fwrite(buf, 1, len, c->fileWrite) < len
+            || fflush(c->fileWrite) == EOF) {
+        hang_up(c);
+    }
+}
+
+/* void init_client_array(ClientArray* a, size_t initialSize)
+* -----------------------------------------------
+* Initializes a new ClientArray 
+* 
+* a: the ClientArray to be initialized
+* initialSize: required initial size of array
+*/
+void init_client_array(ClientArray* a, size_t initialSize) {
+    a->client = malloc(initialSize * sizeof(Client*));
+    a->used = 0;
+    a->size = initialSize;
+    a->count = 0;
+    a->groups = NULL;
+}
+
+/* int insert_client_array(ClientArray* a, Client* element)
+* -----------------------------------------------
+* Inserts a client into ClientArray
+* 
+* a: the ClientArray to be initialized
+* initialSize: required initial size of array
+*
+* Returns: 0, on insertion error
+*          1, on successful insertion
+*/
+int insert_client_array(ClientArray* a, Client* element) {
+    for (int i = 0; i < a->count; i++) {
+        if (a->client[i] == element) {
+            // ERROR: Already in array!
+            return 0;
+        }
+        if (a->client[i]->id == element->id) {
+            // ERROR: Already in array!
+            return 0;
+        }
+    }
+    if (a->used == a->size) {
+        a->size *= 2;
+        a->client = (Client**) realloc(a->client, a->size * sizeof(Client*));
+    }
+    a->client[a->used++] = element;
+    a->count++;
+    return 1;
+}
+
+/* void remove_client(ClientArray* a, int index)
+* -----------------------------------------------
+* Removes a client at a particular index
+* 
+* a: the ClientArray from which client is to be removed
+* index: index of client that is to be removed
+*/
+void remove_client(ClientArray* a, int index) {
+    if (index < 0 || index >= a->count) {
+        return;
+    }
+    for (int i = index; i < a->count - 1; i++) {
+        a->client[i] = a->client[i + 1];
+    }
+    a->count--;
+    a->used--;
+}
+
+/* void delete_client(ClientArray* a, Client* element)
+* -----------------------------------------------
+* Deletes a client from a ClientArray
+* 
+* a: the ClientArray from which element is to be removed
+* element: the client that is to be removed
+*/
+void delete_client(ClientArray* a, Client* element) {
+    for (int i = 0; i < a->count; i++) {
+        if (a->client[i] == element) {
+            remove_client(a, i);
+            return;
+        }
+    }
+}
+
+/* bool topic_empty(ClientArray* a)
+* -----------------------------------------------
+* Checks whether a topic has no subscribers, with or without a filter
+*
+* a: the topic's subscribers
+*
+* Returns: true if there are none
+*/
+bool topic_empty(ClientArray* a) {
+    return a->count == 0 && a->groups == NULL;
+}
+
+/* bool is_subscribed(ClientArray* a, Client* c)
+* -----------------------------------------------
+* Checks whether a client is one of a topic's subscribers, with or without
+* a filter
+*
+* a: the topic's subscribers
+* c: the client
+*
+* Returns: true if the client is subscribed
+*/
+bool is_subscribed(ClientArray* a, Client* c) {
+    for (int i = 0; i < a->count; i++) {
+        if (a->client[i] && a->client[i]->id == c->id) {
+            return true;
+        }
+    }
+    for (FilterGroup* g = a->groups; g; g = g->next) {
+        for (int i = 0; i < g->members.count; i++) {
+            if (g->members.client[i]->id == c->id) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* void add_filtered(ClientArray* a, Client* c, Filter* filter)
+* -----------------------------------------------
+* Adds a client to the group of a topic's subscribers with the same filter,
+* starting a new group if there is none. Must be called with the guard held.
+*
+* a: the topic's subscribers
+* c: the client
+* filter: the client's compiled filter (taken over by the group, or freed
+*         if the group already has one)
+*/
+void add_filtered(ClientArray* a, Client* c, Filter* filter) {
+    FilterGroup* g = a->groups;
+    while (g && !filter_equal(&g->filter, filter)) {
+        g = g->next;
+    }
+    if (g) {
+        filter_free(filter);
+    } else {
+        g = malloc(sizeof(FilterGroup));
+        g->filter = *filter;
+        init_client_array(&g->members, 1);
+        g->next = a->groups;
+        a->groups = g;
+        account_bytes(c->compactor, group_bytes(g));
+    }
+    size_t size = g->members.size;
+    insert_client_array(&g->members, c);
+    account_bytes(c->compactor,
+            (long) (g->members.size - size) * sizeof(Client*));
+}
+
+/* bool unsubscribe(ClientArray* a, Client* c)
+* -----------------------------------------------
+* Removes a client from a topic's subscribers, freeing its filter group if
+* it was the group's last member. Must be called with the guard held.
+*
+* a: the topic's subscribers
+* c: the client
+*
+* Returns: true if the client was subscribed
+*/
+bool unsubscribe(ClientArray* a, Client* c) {
+    for (int i = 0; i < a->count; i++) {
+        if (a->client[i] == c) {
+            remove_client(a, i);
+            return true;
+        }
+    }
+    for (FilterGroup** g = &a->groups; *g; g = &(*g)->next) {
+        FilterGroup* group = *g;
+        for (int i = 0; i < group->members.count; i++) {
+            if (group->members.client[i] != c) {
+                continue;
+            }
+            remove_client(&group->members, i);
+            if (group->members.count == 0) {
+                account_bytes(c->compactor, -group_bytes(group));
+                *g = group->next;
+                filter_free(&group->filter);
+                free_client_array(&group->members);
+                free(group);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+/* void handle_coalesce(Client* client, char* args)
+* -----------------------------------------------
+* Handles the "coalesce bytes usec" and "coalesce off" commands. While
+* coalescing, messages for the client are buffered and sent once bytes have
+* built up or the oldest has waited usec microseconds, whichever is first.
+* Must be called with the guard held.
+*
+* client: the client that sent the command
+* args: the rest of the command line
+*/
+void handle_coalesce(Client* client, char* args) {
+    if (args && strcmp(args, "off") == 0) {
+        flush_output(client);
+        account_bytes(client->compactor, -(long) client->coalesceBytes);
+        free(client->outBuf);
+        client->outBuf = NULL;
+        client->coalesceBytes = 0;
+        return;
+    }
+    char** split = args ? split_by_char(args, ' ', 0) : NULL;
+    char* end;
+    long bytes = -1;
+    long usec = -1;
+    if (split && split[0] && split[1] && !split[2]
+            && isdigit(split[0][0]) && isdigit(split[1][0])) {
+        bytes = strtol(split[0], &end, 10);
+        bytes = (*end == '\0') ? bytes : -1;
+        usec = strtol(split[1], &end, 10);
+        usec = (*end == '\0') ? usec : -1;
+    }
+    free(split);
+    if (bytes <= 0 || bytes > MAX_COALESCE_BYTES || usec <= 0
+            || usec > MAX_COALESCE_USEC) {
+        send_invalid(client);
+        return;
+    }
+    flush_output(client);
+    account_bytes(client->compactor, bytes - (long) client->coalesceBytes);
+    free(client->outBuf);
+    client->outBuf = malloc(bytes);
+    client->coalesceBytes = bytes;
+    client->coalesceUsec = usec;
+}
+
+/* void send_output(Client* c, const char* buf, size_t len)
+* -----------------------------------------------
+* Sends messages to a single subscriber straight away, unless it has been
+* hung up. Must be called with the guard held.
+*
+* c: the subscriber
+* buf: the formatted messages
+* len: length of buf in bytes
+*/
+void send_output(Client* c, const char* buf, size_t len) {
+    if (__atomic_load_n(&c->hungUp, __ATOMIC_RELAXED)) {
+        return;
+    } else if (c->shm) {
+        deliver(c, buf, len);
+    } else if (fflush(c->fileWrite) == EOF) {
+        hang_up(c);
+    } else {
+        int fd = fileno(c->fileWrite);
+        fanout_send(c->fanout, &fd, 1, buf, len);
+    }
+}
+
+/* void buffer_output(Client* c, const char* buf, size_t len)
+* -----------------------------------------------
+* Adds messages to a coalescing subscriber's buffer, sending the buffer first
+* if they don't fit, and sending it as soon as it is full. Messages as large
+* as the buffer are sent straight away. Must be called with the guard held.
+*
+* c: the subscriber
+* buf: the formatted messages
+* len: length of buf in bytes
+*/
+void buffer_output(Client* c, const char* buf, size_t len) {
+    if (c->outLen + len > c->coalesceBytes) {
+        flush_output(c);
+    }
+    if (len >= c->coalesceBytes) {
+        send_output(c, buf, len);
+        return;
+    }
+    if (c->outLen == 0) {
+        arm_timer(c->timers, &c->flushTimer,
+                now_ns() + c->coalesceUsec * 1000ULL);
+    }
+    memcpy(c->outBuf + c->outLen, buf, len);
+    c->outLen += len;
+    if (c->outLen >= c->coalesceBytes) {
+        flush_output(c);
+    }
+}
+
+/* void flush_output(Client* c)
+* -----------------------------------------------
+* Sends any messages buffered for a subscriber and cancels its flush timer.
+* Must be called with the guard held.
+*
+* c: the subscriber
+*/
+void flush_output(Client* c) {
+    if (c->outLen > 0) {
+        send_output(c, c->outBuf, c->outLen);
+        c->outLen = 0;
+        timer_cancel(&c->timers->wheel, &c->flushTimer);
+    }
+}
+
+/* void arm_timer(TimerService* ts, Timer* timer, uint64_t whenNs)
+* -----------------------------------------------
+* Adds (or moves) a timer, waking the timer thread if it would otherwise
+* sleep past it. Must be called with the guard held.
+*
+* ts: the TimerService
+* timer: the timer
+* whenNs: time (ns, CLOCK_MONOTONIC) at which the timer should expire
+*/
+void arm_timer(TimerService* ts, Timer* timer, uint64_t whenNs) {
+    timer_add(&ts->wheel, timer, whenNs);
+    wake_timers(ts, whenNs);
+}
+
+/* void arm_idle_timer(TimerService* ts, Timer* timer, uint64_t whenNs)
+* -----------------------------------------------
+* Adds a client's idle timer, waking the timer thread if it would otherwise
+* sleep past it. The guard is not needed.
+*
+* ts: the TimerService
+* timer: the idle timer
+* whenNs: time (ns, CLOCK_MONOTONIC) at which the timer should expire
+*/
+void arm_idle_timer(TimerService* ts, Timer* timer, uint64_t whenNs) {
+    pthread_mutex_lock(&ts->idleLock);
+    timer_add(&ts->idleWheel, timer, whenNs);
+    pthread_mutex_unlock(&ts->idleLock);
+    wake_timers(ts, whenNs);
+}
+
+/* void wake_timers(TimerService* ts, uint64_t whenNs)
+* -----------------------------------------------
+* Wakes the timer thread if it would otherwise sleep past a timer that has
+* just been added. While the thread is looking at the wheels wakeAt is
+* UINT64_MAX, so a timer added then always wakes it again.
+*
+* ts: the TimerService
+* whenNs: time (ns, CLOCK_MONOTONIC) at which the timer expires
+*/
+void wake_timers(TimerService* ts, uint64_t whenNs) {
+    uint64_t wakeAt = __atomic_load_n(&ts->wakeAt, __ATOMIC_RELAXED);
+    while (whenNs < wakeAt) {
+        if (__atomic_compare_exchange_n(&ts->wakeAt, &wakeAt, whenNs, false,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            sem_post(&ts->wake);
+            return;
+        }
+    }
+}
+
+/* void* timer_thread(void* arg)
+* -----------------------------------------------
+* Function that is passed to the dedicated timer thread. Runs the idle
+* timers that have expired, then the other timers with the guard held, then
+* sleeps until a wheel next needs attention or an earlier timer is added.
+* It gives up waiting for the guard when the next idle timer is due, so a
+* client that holds the guard while blocked sending to a subscriber that
+* has stopped reading can't stop that subscriber being disconnected.
+*
+* arg: the TimerService
+*/
+void* timer_thread(void* arg) {
+    TimerService* ts = arg;
+    for (;;) {
+        __atomic_store_n(&ts->wakeAt, UINT64_MAX, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&ts->idleLock);
+        timer_wheel_advance(&ts->idleWheel, now_ns());
+        uint64_t next = timer_wheel_next(&ts->idleWheel);
+        pthread_mutex_unlock(&ts->idleLock);
+        if (!take_lock_until(ts->guard, next)) {
+            continue;
+        }
+        timer_wheel_advance(&ts->wheel, now_ns());
+        uint64_t wheelNext = timer_wheel_next(&ts->wheel);
+        release_lock(ts->guard);
+        next = (wheelNext < next) ? wheelNext : next;
+        __atomic_store_n(&ts->wakeAt, next, __ATOMIC_RELAXED);
+        if (next == UINT64_MAX) {
+            while (sem_wait(&ts->wake) < 0 && errno == EINTR) {
+            }
+            continue;
+        }
+        if (next <= now_ns()) {
+            continue;
+        }
+        struct timespec wake;
+        realtime_deadline(next, &wake);
+        while (sem_timedwait(&ts->wake, &wake) < 0 && errno == EINTR) {
+        }
+    }
+    return NULL;
+}
+
+/* void realtime_deadline(uint64_t whenNs, struct timespec* deadline)
+* -----------------------------------------------
+* Converts a CLOCK_MONOTONIC time into the absolute CLOCK_REALTIME time
+* that sem_timedwait() takes
+*
+* whenNs: time (ns, CLOCK_MONOTONIC) to convert
+* deadline: set to the same time on CLOCK_REALTIME
+*/
+void realtime_deadline(uint64_t whenNs, struct timespec* deadline) {
+    uint64_t now = now_ns();
+    clock_gettime(CLOCK_REALTIME, deadline);
+    uint64_t wait = (whenNs > now ? whenNs - now : 0) + deadline->tv_nsec;
+    deadline->tv_sec += wait / 1000000000ULL;
+    deadline->tv_nsec = wait % 1000000000ULL;
+}
+
+/* void flush_expired(Timer* timer, void* arg)
+* -----------------------------------------------
+* Sends a coalescing client's buffered messages once the oldest has waited
+* as long as the client allows. Called by the timer thread with the guard
+* held.
+*
+* timer: the client's flush timer
+* arg: the client
+*/
+void flush_expired(Timer* timer, void* arg) {
+    flush_output((Client *) arg);
+}
+
+/* void idle_expired(Timer* timer, void* arg)
+* -----------------------------------------------
+* Disconnects a client that has sent nothing for the idle timeout. Input
+* doesn't move the timer, so if there has been some since it was added it
+* is just added again for the new deadline. The connection is shut down,
+* which wakes the client's thread to close it as usual. Called by the timer
+* thread with idleLock held, but not the guard.
+*
+* timer: the client's idle timer
+* arg: the client
+*/
+void idle_expired(Timer* timer, void* arg) {
+    Client* c = arg;
+    uint64_t deadline = __atomic_load_n(&c->lastInput, __ATOMIC_RELAXED)
+            + c->timers->idleNs;
+    if (deadline > now_ns()) {
+        timer_add(&c->timers->idleWheel, timer, deadline);
+        return;
+    }
+    hang_up(c);
+}
+
+/* void heartbeat_expired(Timer* timer, void* arg)
+* -----------------------------------------------
+* Sends a client a heartbeat, after any messages buffered for it, and adds
+* the timer again for the next one. Called by the timer thread with the
+* guard held.
+*
+* timer: the client's heartbeat timer
+* arg: the client
+*/
+void heartbeat_expired(Timer* timer, void* arg) {
+    Client* c = arg;
+    flush_output(c);
+    send_output(c, HEARTBEAT, strlen(HEARTBEAT));
+    arm_timer(c->timers, timer, now_ns() + c->timers->heartbeatNs);
+}
+
+/* void hang_up(Client* c)
+* -----------------------------------------------
+* Shuts down a client's connection, which wakes the client's thread to
+* close it as usual, and marks it so that nothing more is sent to it. Safe
+* to call from any thread until the client is closed.
+*
+* c: the client
+*/
+void hang_up(Client* c) {
+    __atomic_store_n(&c->hungUp, true, __ATOMIC_RELAXED);
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+/* void close_client(Client* client)
+* -----------------------------------------------
+* Closes a disconnected client's streams and hands it to the compactor. The
+* client is marked inactive so that nothing is sent to it while it is still
+* in subscriber lists, and its timers and any buffered messages are
+* dropped. Must be called with the guard held.
+*
+* client: the client that has disconnected
+*/
+void close_client(Client* client) {
+    Compactor* co = client->compactor;
+    TimerService* ts = client->timers;
+    client->active = false;
+    client->outLen = 0;
+    timer_cancel(&ts->wheel, &client->flushTimer);
+    timer_cancel(&ts->wheel, &client->heartbeatTimer);
+    // Once cancelled the idle timer can't be running, so the socket can go
+    pthread_mutex_lock(&ts->idleLock);
+    timer_cancel(&ts->idleWheel, &client->idleTimer);
+    pthread_mutex_unlock(&ts->idleLock);
+    fclose(client->fileRead);
+    fclose(client->fileWrite);
+    close(client->fd);
+    client->statistics[0]--;
+    client->statistics[1]++;
+    if (client->capture) {
+        capture_record(client->capture, now_ns(), client->id, CAPTURE_CLOSE,
+                NULL, 0);
+    }
+    insert_client_array(&co->dead, client);
+    sem_post(&co->wake);
+}
+
+/* void queue_empty_topic(Compactor* co, char* topic, ClientArray* a)
+* -----------------------------------------------
+* Hands a topic whose last subscriber has left to the compactor. The topic
+* is only freed if it is still empty when the compactor gets to it. Must be
+* called with the guard held.
+*
+* co: the Compactor
+* topic: the topic
+* a: the topic's subscribers
+*/
+void queue_empty_topic(Compactor* co, char* topic, ClientArray* a) {
+    if (stringmap_add(co->empty, topic, a)) {
+        sem_post(&co->wake);
+    }
+}
+
+/* void* compact_thread(void* arg)
+* -----------------------------------------------
+* Function that is passed to the dedicated compaction thread. Once woken,
+* waits COMPACT_DELAY_USEC for more garbage to build up, then reclaims it
+* COMPACT_BATCH items at a time, releasing the guard between batches so
+* publishers can get in.
+*
+* arg: the Compactor
+*/
+void* compact_thread(void* arg) {
+    Compactor* co = arg;
+    for (;;) {
+        while (sem_wait(&co->wake) < 0 && errno == EINTR) {
+        }
+        usleep(COMPACT_DELAY_USEC);
+        while (sem_trywait(&co->wake) == 0) {
+            // Everything posted so far is reclaimed below
+        }
+        int more = 1;
+        while (more) {
+            take_lock(co->guard);
+            more = compact_batch(co);
+            release_lock(co->guard);
+        }
+    }
+    return NULL;
+}
+
+/* int compact_batch(Compactor* co)
+* -----------------------------------------------
+* Reclaims up to COMPACT_BATCH items: subscriptions of disconnected clients,
+* then the clients themselves once they have none left, then topics left
+* without subscribers. Must be called with the guard held.
+*
+* co: the Compactor
+*
+* Returns: 1 if there may be more to reclaim, 0 otherwise
+*/
+int compact_batch(Compactor* co) {
+    for (int done = 0; done < COMPACT_BATCH; done++) {
+        StringMapItem* smi;
+        if (co->dead.count > 0) {
+            Client* c = co->dead.client[co->dead.count - 1];
+            if ((smi = stringmap_iterate(c->subs, NULL))) {
+                ClientArray* a = smi->item;
+                unsubscribe(a, c);
+                if (topic_empty(a)) {
+                    stringmap_add(co->empty, smi->key, a);
+                }
+                co->gauges.subscriptions--;
+                account_bytes(co, -subscription_bytes(smi->key));
+                stringmap_remove(c->subs, smi->key);
+            } else {
+                remove_client(&co->dead, co->dead.count - 1);
+                free_client(c);
+            }
+        } else if ((smi = stringmap_iterate(co->empty, NULL))) {
+            ClientArray* a = smi->item;
+            if (topic_empty(a)) {
+                // Resubscribed topics are left alone
+                co->gauges.topics--;
+                account_bytes(co, -topic_bytes(a, smi->key));
+                stringmap_remove(co->sm, smi->key);
+                free_client_array(a);
+                free(a);
+            }
+            stringmap_remove(co->empty, smi->key);
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* void free_client(Client* c)
+* -----------------------------------------------
+* Frees a disconnected client that is no longer referenced by any topic.
+* Must be called with the guard held.
+*
+* c: the client to be freed
+*/
+void free_client(Client* c) {
+    Compactor* co = c->compactor;
+    co->gauges.clients--;
+    account_bytes(co, -(long) (sizeof(Client) + c->inSize + 1
+            + c->coalesceBytes));
+    stringmap_free(c->subs);
+    free(c->inBuf);
+    free(c->outBuf);
+    free(c->name);
+    free(c);
+}
+
+/* long topic_bytes(ClientArray* a, char* topic)
+* -----------------------------------------------
+* Estimates the memory held by a topic and its subscriber list
+*
+* a: the topic's subscribers
+* topic: the topic
+*
+* Returns: the estimate in bytes
+*/
+long topic_bytes(ClientArray* a, char* topic) {
+    return sizeof(ClientArray) + a->size * sizeof(Client*)
+            + sizeof(StringMapItem) + sizeof(StringMapItem*)
+            + strlen(topic) + 1;
+}
+
+/* long group_bytes(FilterGroup* g)
+* -----------------------------------------------
+* Estimates the memory held by a filter group, other than its member list
+* growing
+*
+* g: the group
+*
+* Returns: the estimate in bytes
+*/
+long group_bytes(FilterGroup* g) {
+    return sizeof(FilterGroup) + g->members.size * sizeof(Client*)
+            + g->filter.len + 1;
+}
+
+/* long subscription_bytes(char* topic)
+* -----------------------------------------------
+* Estimates the memory held by a client's record of one subscription
+*
+* topic: the topic subscribed to
+*
+* Returns: the estimate in bytes
+*/
+long subscription_bytes(char* topic) {
+    return sizeof(StringMapItem) + sizeof(StringMapItem*) + strlen(topic) + 1;
+}
+
+/* void account_bytes(Compactor* co, long delta)
+* -----------------------------------------------
+* Adjusts the memory held gauge. Safe to call without the guard.
+*
+* co: the Compactor holding the gauge
+* delta: bytes allocated (positive) or freed (negative)
+*/
+void account_bytes(Compactor* co, long delta) {
+    __atomic_add_fetch(&co->gauges.bytes, delta, __ATOMIC_RELAXED);
+}
+
+/* void print_client_array(ClientArray* a, StringMap* sm)
+* -----------------------------------------------
+* Prints out the elements of Client Array as well as StringMap
+* 
+* a: the ClientArray to be printed
+* sm: the StringMap to be printed
+*/
+void print_client_array(ClientArray* a, StringMap* sm) {
+    printf("[");
+    for (int i = 0; i < a->count; i++) {
+        if (a->client[i] != NULL) {
+            printf(" %d ", a->client[i]->id);
+        }
     }
     printf("]\n");
     printf("-----\n");
@@ -521,6 +2277,97 @@ void free_client_array(ClientArray* a) {
     a->used = a->size = 0;
 }
 
+/* void init_rate_limiter(RateLimiter* rl, int rate, int burst)
+* -----------------------------------------------
+* Initializes a rate limiter. A rate of 0 disables the limiter.
+*
+* rl: the limiter to be initialized
+* rate: messages per second allowed for each key
+* burst: messages that may be sent at once by each key
+*/
+void init_rate_limiter(RateLimiter* rl, int rate, int burst) {
+    rl->buckets = NULL;
+    rl->interval = rl->tolerance = 0;
+    if (rate <= 0) {
+        return;
+    }
+    rl->interval = 1000000000ULL / rate;
+    rl->tolerance = rl->interval * burst;
+    rl->buckets = calloc(RATE_SLOTS, sizeof(RateBucket));
+}
+
+/* int rate_allow(RateLimiter* rl, const char* key, int count)
+* -----------------------------------------------
+* Takes count tokens from the key's bucket if they are available. Buckets are
+* claimed and updated with atomic operations only, so no lock is taken. A
+* bucket that is full (tat not after now) holds no state, so a key without
+* a bucket may take it over from its owner. If every bucket the key could
+* use is in use, the key shares the bucket at its home slot.
+*
+* rl: the limiter to be checked
+* key: the client name or topic
+* count: number of tokens required
+*
+* Returns: 1 if the tokens were taken, 0 if the key is over its limit
+*/
+int rate_allow(RateLimiter* rl, const char* key, int count) {
+    if (rl->interval == 0) {
+        return 1;
+    }
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (const char* p = key; *p; p++) {
+        hash = (hash ^ (unsigned char) *p) * 1099511628211ULL;
+    }
+    hash |= 1; // 0 marks an unused bucket
+    uint64_t now = now_ns();
+    RateBucket* bucket = NULL;
+    RateBucket* idle = NULL;
+    uint64_t idleOwner = 0;
+    for (int i = 0; i < RATE_PROBES && !bucket; i++) {
+        RateBucket* b = &rl->buckets[(hash + i) & (RATE_SLOTS - 1)];
+        uint64_t owner = __atomic_load_n(&b->key, __ATOMIC_RELAXED);
+        if (owner == hash) {
+            bucket = b;
+        } else if (!idle && (owner == 0
+                || __atomic_load_n(&b->tat, __ATOMIC_RELAXED) <= now)) {
+            idle = b;
+            idleOwner = owner;
+        }
+    }
+    if (!bucket && idle) {
+        // Fails if another key claimed it first, leaving owner its new key
+        uint64_t owner = idleOwner;
+        if (__atomic_compare_exchange_n(&idle->key, &owner, hash, false,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED) || owner == hash) {
+            bucket = idle;
+        }
+    }
+    if (!bucket) {
+        bucket = &rl->buckets[hash & (RATE_SLOTS - 1)];
+    }
+    uint64_t cost = rl->interval * (uint64_t) count;
+    uint64_t tat = __atomic_load_n(&bucket->tat, __ATOMIC_RELAXED);
+    uint64_t next;
+    do {
+        next = ((tat > now) ? tat : now) + cost;
+        if (next - now > rl->tolerance) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&bucket->tat, &tat, next, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/* uint64_t now_ns(void)
+* -----------------------------------------------
+* Returns: the current monotonic time in nanoseconds
+*/
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 /* void init_lock(sem_t* l)
 * -----------------------------------------------
 * Initializes a semphore lock
@@ -539,30 +2386,37 @@ void take_lock(sem_t* l) {
     sem_wait(l);
 }
 
-/* void release_lock(sem_t* l)
+/* bool take_lock_until(sem_t* l, uint64_t whenNs)
 * -----------------------------------------------
-* Releases lock from calling thread
-* 
+* Acquires lock for calling thread, giving up at a deadline
+*
+* l: semaphore lock
+* whenNs: time (ns, CLOCK_MONOTONIC) to give up at, UINT64_MAX for never
+*
+* Returns: true if the lock was acquired, false if the deadline passed
 */
-void release_lock(sem_t* l) {
-    sem_post(l);
+bool take_lock_until(sem_t* l, uint64_t whenNs) {
+    if (whenNs == UINT64_MAX) {
+        take_lock(l);
+        return true;
+    }
+    struct timespec deadline;
+    realtime_deadline(whenNs, &deadline);
+    while (sem_timedwait(l, &deadline) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
 }
 
-/* int is_valid_string(char* s)
+/* void release_lock(sem_t* l)
 * -----------------------------------------------
-* Checks if the passed string is valid or not
-*
-* s: string to be checked
+* Releases lock from calling thread
 * 
-* Returns: 0, if invalid
-*          1, if valid
 */
-int is_valid_string(char* s) {
-    if (strchr(s, ' ') || strchr(s, ':') || strchr(s, '\n')) {
-        return 0;
-    } else {
-        return 1;
-    }
+void release_lock(sem_t* l) {
+    sem_post(l);
 }
 
 /* void print_err() 
@@ -585,25 +2439,58 @@ void print_socket_err() {
     exit(2);
 }
 
+/* void print_capture_err()
+* -----------------------------------------------
+* Prints the error message for a capture file that can't be created
+* Exits with code 3
+*/
+void print_capture_err() {
+    fprintf(stderr, "psserver: unable to open capture file\n");
+    exit(3);
+}
+
 /* void* sig_thread(void *arg)
 * -----------------------------------------------
 * Function that is passed to the dedicated signal handling thread
-* Prints out client and subscription/publication statistics
+* On SIGHUP, prints out client and subscription/publication statistics, the
+* size of the server's data structures, and the number of sends made to
+* subscribers with the system calls they took. On SIGINT or SIGTERM (only
+* waited for while capturing), writes out the capture file and then lets
+* the signal terminate the server as usual.
 * arg: struct of args passed to signal handling thread
 * 
 */
 void* sig_thread(void* arg) {
-    // SigArgs* args;
-    sigset_t* set = arg;
+    SigArgs* args = arg;
+    sigset_t* set = args->set;
     int s, sig;
     // statistics[0] = connected clients, [1] completed clients, [2] pub ops
     // [3] sub ops, [4] unsub ops
-    int statistics[5] = {0};
+    int statistics[5];
+    Gauges gauges;
+    unsigned long fanoutSends, fanoutSyscalls;
     for (;;) {
         s = sigwait(set, &sig);
         if (s != 0) {
             // ERROR!
         }
+        if (sig == SIGINT || sig == SIGTERM) {
+            capture_close(args->capture);
+            sigset_t stop;
+            sigemptyset(&stop);
+            sigaddset(&stop, sig);
+            signal(sig, SIG_DFL);
+            pthread_sigmask(SIG_UNBLOCK, &stop, NULL);
+            raise(sig);
+        }
+        take_lock(args->guard);
+        memcpy(statistics, args->statistics, sizeof(statistics));
+        gauges = args->compactor->gauges;
+        gauges.bytes = __atomic_load_n(&args->compactor->gauges.bytes,
+                __ATOMIC_RELAXED);
+        fanoutSends = args->fanout->messages;
+        fanoutSyscalls = args->fanout->syscalls;
+        release_lock(args->guard);
         printf("Connected clients:%d\n", statistics[0]);
         fflush(stdout);
         printf("Completed clients:%d\n", statistics[1]);
@@ -614,5 +2501,12 @@ void* sig_thread(void* arg) {
         fflush(stdout);
         printf("unsub operations:%d\n", statistics[4]);
         fflush(stdout);
+        printf("Live topics:%d\n", gauges.topics);
+        printf("Subscriptions:%d\n", gauges.subscriptions);
+        printf("Clients held:%d\n", gauges.clients);
+        printf("Memory held:%ld\n", gauges.bytes);
+        printf("Fan-out sends:%lu\n", fanoutSends);
+        printf("Fan-out syscalls:%lu\n", fanoutSyscalls);
+        fflush(stdout);
     }
 }
\ No newline at end of file
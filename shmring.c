@@ -0,0 +1,373 @@
+// shmring.c
+// Author: Rohith Kotia Palakirti
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include "shmring.h"
+
+// Number of descriptors passed from the server to the client: the memfd and
+// a data and space eventfd for each of the two rings
+#define SHM_LINK_FDS 5
+
+/*
+ * Function Prototypes
+ */
+static ShmLink* shm_link_map(int* fds, int sock, bool server);
+static int shm_link_wait(ShmLink* link, int eventFd, int timeoutMs);
+static void shm_link_signal(int eventFd);
+static ssize_t shm_cookie_read(void* cookie, char* buf, size_t size);
+static ssize_t shm_cookie_write(void* cookie, const char* buf, size_t size);
+static int shm_cookie_close(void* cookie);
+
+/* ShmLink* shm_link_create(int sock)
+* -----------------------------------------------
+* Creates a shared memory link and passes it to the peer on the other end of
+* a unix domain socket. The socket is kept to detect the peer going away and
+* must not be used for anything else afterwards.
+*
+* sock: connected unix domain socket to the peer
+*
+* Returns: the server end of the link, or NULL on failure
+*/
+ShmLink* shm_link_create(int sock) {
+    int fds[SHM_LINK_FDS];
+    fds[0] = memfd_create("psserver", MFD_CLOEXEC);
+    if (fds[0] < 0) {
+        return NULL;
+    }
+    if (ftruncate(fds[0], 2 * sizeof(ShmRing)) < 0) {
+        close(fds[0]);
+        return NULL;
+    }
+    for (int i = 1; i < SHM_LINK_FDS; i++) {
+        fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    }
+    char cmsgBuf[CMSG_SPACE(sizeof(fds))];
+    memset(cmsgBuf, 0, sizeof(cmsgBuf));
+    char tag = 'S';
+    struct iovec iov = {.iov_base = &tag, .iov_len = 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgBuf;
+    msg.msg_controllen = sizeof(cmsgBuf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1) {
+        for (int i = 0; i < SHM_LINK_FDS; i++) {
+            close(fds[i]);
+        }
+        return NULL;
+    }
+    return shm_link_map(fds, sock, true);
+}
+
+/* ShmLink* shm_link_accept(int sock)
+* -----------------------------------------------
+* Receives a shared memory link sent by shm_link_create()
+*
+* sock: connected unix domain socket to the server
+*
+* Returns: the client end of the link, or NULL on failure
+*/
+ShmLink* shm_link_accept(int sock) {
+    int fds[SHM_LINK_FDS];
+    char cmsgBuf[CMSG_SPACE(sizeof(fds))];
+    char tag;
+    struct iovec iov = {.iov_base = &tag, .iov_len = 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgBuf;
+    msg.msg_controllen = sizeof(cmsgBuf);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 || tag != 'S') {
+        return NULL;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        return NULL;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    return shm_link_map(fds, sock, false);
+}
+
+/* static ShmLink* shm_link_map(int* fds, int sock, bool server)
+* -----------------------------------------------
+* Maps the shared rings and builds one end of a link. Ring 0 carries data
+* from the client to the server and ring 1 from the server to the client.
+*
+* fds: the memfd followed by ring 0's data and space eventfds, then ring 1's
+* sock: socket used to detect the peer going away
+* server: true for the server end of the link
+*
+* Returns: the link, or NULL on failure
+*/
+static ShmLink* shm_link_map(int* fds, int sock, bool server) {
+    void* base = mmap(NULL, 2 * sizeof(ShmRing), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (base == MAP_FAILED) {
+        for (int i = 1; i < SHM_LINK_FDS; i++) {
+            close(fds[i]);
+        }
+        return NULL;
+    }
+    ShmLink* link = malloc(sizeof(ShmLink));
+    ShmRing* rings = base;
+    int rx = server ? 0 : 1;
+    int tx = 1 - rx;
+    link->base = base;
+    link->rx = &rings[rx];
+    link->tx = &rings[tx];
+    link->rxData = fds[1 + 2 * rx];
+    link->rxSpace = fds[2 + 2 * rx];
+    link->txData = fds[1 + 2 * tx];
+    link->txSpace = fds[2 + 2 * tx];
+    link->hupFd = sock;
+    link->refs = 0;
+    link->writeTimeoutMs = -1;
+    return link;
+}
+
+/* static int shm_link_wait(ShmLink* link, int eventFd, int timeoutMs)
+* -----------------------------------------------
+* Blocks until the eventfd is signalled, the peer goes away or the timeout
+* expires
+*
+* link: the link being waited on
+* eventFd: the eventfd to wait for
+* timeoutMs: longest time to wait in milliseconds, -1 for no limit
+*
+* Returns: 1 if the eventfd was signalled, 0 if the peer has gone away or
+*          the timeout expired
+*/
+static int shm_link_wait(ShmLink* link, int eventFd, int timeoutMs) {
+    struct pollfd pfds[2] = {
+        {.fd = eventFd, .events = POLLIN},
+        {.fd = link->hupFd, .events = POLLIN}
+    };
+    int ready;
+    while ((ready = poll(pfds, 2, timeoutMs)) < 0) {
+        if (errno != EINTR) {
+            return 0;
+        }
+    }
+    if (ready == 0) {
+        return 0;
+    }
+    if (pfds[0].revents & POLLIN) {
+        uint64_t value;
+        if (read(eventFd, &value, sizeof(value)) < 0) {
+            // EAGAIN: already drained, nothing to do
+        }
+        return 1;
+    }
+    // Nothing is sent on the socket once the link is up, so any activity on
+    // it means the peer has closed it
+    return 0;
+}
+
+/* static void shm_link_signal(int eventFd)
+* -----------------------------------------------
+* Wakes the peer blocked on an eventfd
+*
+* eventFd: the eventfd to signal
+*/
+static void shm_link_signal(int eventFd) {
+    uint64_t one = 1;
+    if (write(eventFd, &one, sizeof(one)) < 0) {
+        // EAGAIN: counter saturated, the peer will wake anyway
+    }
+}
+
+/* ssize_t shm_link_read(ShmLink* link, char* buf, size_t len)
+* -----------------------------------------------
+* Reads up to len bytes from the link, blocking until at least one byte is
+* available. The eventfd is only used when the ring is empty, so a busy link
+* is read without any system calls.
+*
+* link: the link to read from
+* buf: buffer to read into
+* len: size of buf
+*
+* Returns: number of bytes read, or 0 once the peer has gone away and every
+*          byte it sent has been read, or if it has claimed to have written
+*          more than the ring holds
+*/
+ssize_t shm_link_read(ShmLink* link, char* buf, size_t len) {
+    ShmRing* ring = link->rx;
+    uint64_t tail = ring->tail;
+    while (1) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head - tail > SHM_RING_SIZE) {
+            return 0; // The peer can write anything here; don't trust it
+        }
+        if (head != tail) {
+            size_t n = head - tail;
+            n = (n < len) ? n : len;
+            size_t offset = tail % SHM_RING_SIZE;
+            size_t first = SHM_RING_SIZE - offset;
+            first = (first < n) ? first : n;
+            memcpy(buf, ring->data + offset, first);
+            memcpy(buf + first, ring->data, n - first);
+            __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->producerWaiting, __ATOMIC_RELAXED)) {
+                shm_link_signal(link->rxSpace);
+            }
+            return n;
+        }
+        // Announce that we are about to sleep, then look again so a write
+        // that raced with us is not missed
+        __atomic_store_n(&ring->consumerWaiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail
+                && !shm_link_wait(link, link->rxData, -1)
+                && __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+            __atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_RELAXED);
+            return 0;
+        }
+        __atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* ssize_t shm_link_write(ShmLink* link, const char* buf, size_t len)
+* -----------------------------------------------
+* Writes all of buf to the link, blocking while the ring is full (for at
+* most writeTimeoutMs at a time). Only one thread may write to a link
+* at a time.
+*
+* link: the link to write to
+* buf: data to be written
+* len: number of bytes to write
+*
+* Returns: len, or -1 if the peer went away or stopped reading before
+*          everything was written, or if it has claimed to have read more
+*          than was written
+*/
+ssize_t shm_link_write(ShmLink* link, const char* buf, size_t len) {
+    ShmRing* ring = link->tx;
+    uint64_t head = ring->head;
+    size_t remaining = len;
+    while (remaining > 0) {
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - tail > SHM_RING_SIZE) {
+            return -1; // The peer can write anything here; don't trust it
+        }
+        size_t space = SHM_RING_SIZE - (head - tail);
+        if (space == 0) {
+            __atomic_store_n(&ring->producerWaiting, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == tail
+                    && !shm_link_wait(link, link->txSpace,
+                        link->writeTimeoutMs)) {
+                __atomic_store_n(&ring->producerWaiting, 0, __ATOMIC_RELAXED);
+                return -1;
+            }
+            __atomic_store_n(&ring->producerWaiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        size_t n = (space < remaining) ? space : remaining;
+        size_t offset = head % SHM_RING_SIZE;
+        size_t first = SHM_RING_SIZE - offset;
+        first = (first < n) ? first : n;
+        memcpy(ring->data + offset, buf, first);
+        memcpy(ring->data, buf + first, n - first);
+        head += n;
+        buf += n;
+        remaining -= n;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->consumerWaiting, __ATOMIC_RELAXED)) {
+            shm_link_signal(link->txData);
+        }
+    }
+    return len;
+}
+
+/* FILE* shm_link_fopen(ShmLink* link, const char* mode)
+* -----------------------------------------------
+* Opens a stdio stream on a link so it can be used wherever a socket stream
+* is used. The link is closed when every stream opened on it is closed.
+*
+* link: the link to open
+* mode: "r" or "w"
+*
+* Returns: the stream, or NULL on failure
+*/
+FILE* shm_link_fopen(ShmLink* link, const char* mode) {
+    cookie_io_functions_t io = {
+        .read = shm_cookie_read,
+        .write = shm_cookie_write,
+        .seek = NULL,
+        .close = shm_cookie_close
+    };
+    FILE* f = fopencookie(link, mode, io);
+    if (f) {
+        __atomic_add_fetch(&link->refs, 1, __ATOMIC_RELAXED);
+    }
+    return f;
+}
+
+/* void shm_link_close(ShmLink* link)
+* -----------------------------------------------
+* Unmaps the rings and closes every descriptor held by a link
+*
+* link: the link to close
+*/
+void shm_link_close(ShmLink* link) {
+    munmap(link->base, 2 * sizeof(ShmRing));
+    close(link->rxData);
+    close(link->rxSpace);
+    close(link->txData);
+    close(link->txSpace);
+    close(link->hupFd);
+    free(link);
+}
+
+/* static ssize_t shm_cookie_read(void* cookie, char* buf, size_t size)
+* -----------------------------------------------
+* fopencookie() read function for a link
+*/
+static ssize_t shm_cookie_read(void* cookie, char* buf, size_t size) {
+    return shm_link_read((ShmLink *) cookie, buf, size);
+}
+
+/* static ssize_t shm_cookie_write(void* cookie, const char* buf, size_t size)
+* -----------------------------------------------
+* fopencookie() write function for a link. Returns 0 (an error to stdio)
+* if the peer has gone away.
+*/
+static ssize_t shm_cookie_write(void* cookie, const char* buf, size_t size) {
+    ssize_t written = shm_link_write((ShmLink *) cookie, buf, size);
+    return (written < 0) ? 0 : written;
+}
+
+/* static int shm_cookie_close(void* cookie)
+* -----------------------------------------------
+* fopencookie() close function for a link
+*/
+static int shm_cookie_close(void* cookie) {
+    ShmLink* link = cookie;
+    if (__atomic_sub_fetch(&link->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        shm_link_close(link);
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+// shmring.h
+// Author: Rohith Kotia Palakirti
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Bytes of message data held by each direction of a shared memory link
+#define SHM_RING_SIZE (1 << 20)
+
+/* ShmRing Struct
+* -----------------------------------------------
+* Single producer, single consumer byte ring that lives in shared memory.
+* head and tail count bytes written and read since the ring was created and
+* are kept on separate cache lines so the two ends don't contend.
+* head: total bytes written by the producer
+* consumerWaiting: set while the consumer is blocked waiting for data
+* tail: total bytes read by the consumer
+* producerWaiting: set while the producer is blocked waiting for space
+* data: SHM_RING_SIZE bytes of ring storage
+*/
+typedef struct ShmRing {
+    uint64_t head;
+    uint32_t consumerWaiting;
+    char padHead[52];
+    uint64_t tail;
+    uint32_t producerWaiting;
+    char padTail[52];
+    char data[SHM_RING_SIZE];
+} ShmRing;
+
+/* ShmLink Struct
+* -----------------------------------------------
+* One end of a shared memory link: a pair of rings (one per direction) in a
+* memfd mapping, plus eventfds used to wake a blocked peer
+* base: start of the shared mapping
+* rx: ring this end reads from
+* tx: ring this end writes to
+* rxData: eventfd signalled by the peer after it writes to rx
+* rxSpace: eventfd signalled to the peer after space is freed in rx
+* txData, txSpace: the same pair of eventfds for tx
+* hupFd: the unix socket used to set up the link, readable once the peer
+*        has gone away
+* refs: number of open streams using the link
+* writeTimeoutMs: longest a write waits for the peer to make room, in
+*                 milliseconds, or -1 (the default) to wait as long as it
+*                 takes
+*/
+typedef struct ShmLink {
+    void* base;
+    ShmRing* rx;
+    ShmRing* tx;
+    int rxData;
+    int rxSpace;
+    int txData;
+    int txSpace;
+    int hupFd;
+    int refs;
+    int writeTimeoutMs;
+} ShmLink;
+
+/*
+ * Function Prototypes
+ */
+ShmLink* shm_link_create(int sock);
+ShmLink* shm_link_accept(int sock);
+ssize_t shm_link_read(ShmLink* link, char* buf, size_t len);
+ssize_t shm_link_write(ShmLink* link, const char* buf, size_t len);
+FILE* shm_link_fopen(ShmLink* link, const char* mode);
+void shm_link_close(ShmLink* link);
+
+#endif
@@ -179,7 +179,7 @@ StringMapItem* stringmap_iterate(StringMap* sm, StringMapItem* prev) {
         return NULL;
     }
     if (prev == NULL) {
-        return sm->sm[0];
+        return (sm->count > 0) ? sm->sm[0] : NULL;
     }
     for (int i = 0; i < sm->count; i++) {
         if (sm->sm[i] == prev) {
@@ -0,0 +1,219 @@
+// timerwheel.c
+// Author: Rohith Kotia Palakirti
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "timerwheel.h"
+
+/*
+ * Function Prototypes
+ */
+static void timer_file(TimerWheel* wheel, Timer* timer);
+static void timer_unlink(TimerWheel* wheel, Timer* timer);
+static void timer_cascade(TimerWheel* wheel, int level, int slot);
+
+/* void timer_wheel_init(TimerWheel* wheel, uint64_t tickNs, uint64_t nowNs)
+* -----------------------------------------------
+* Initializes an empty TimerWheel
+*
+* wheel: the TimerWheel to be initialized
+* tickNs: length of a tick in ns; timers expire up to one tick late
+* nowNs: the current time in ns
+*/
+void timer_wheel_init(TimerWheel* wheel, uint64_t tickNs, uint64_t nowNs) {
+    memset(wheel, 0, sizeof(TimerWheel));
+    wheel->tickNs = tickNs;
+    wheel->originNs = nowNs;
+}
+
+/* void timer_init(Timer* timer, TimerFunc fire, void* arg)
+* -----------------------------------------------
+* Initializes a timer that is not pending
+*
+* timer: the Timer to be initialized
+* fire: function called when the timer expires
+* arg: passed to fire
+*/
+void timer_init(Timer* timer, TimerFunc fire, void* arg) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->fire = fire;
+    timer->arg = arg;
+}
+
+/* int timer_pending(Timer* timer)
+* -----------------------------------------------
+* Checks whether a timer has been added and has not expired or been
+* cancelled
+*
+* timer: the Timer to check
+*
+* Returns: 1 if the timer is pending, 0 otherwise
+*/
+int timer_pending(Timer* timer) {
+    return timer->prev != NULL;
+}
+
+/* void timer_add(TimerWheel* wheel, Timer* timer, uint64_t whenNs)
+* -----------------------------------------------
+* Adds a timer to expire at the first tick at or after whenNs, cancelling it
+* first if it is already pending. A time that has already passed expires on
+* the next tick.
+*
+* wheel: the TimerWheel to add to
+* timer: the Timer to add
+* whenNs: time (ns) at which the timer should expire
+*/
+void timer_add(TimerWheel* wheel, Timer* timer, uint64_t whenNs) {
+    if (timer_pending(timer)) {
+        timer_unlink(wheel, timer);
+    }
+    uint64_t tick = 0;
+    if (whenNs > wheel->originNs) {
+        tick = (whenNs - wheel->originNs + wheel->tickNs - 1) / wheel->tickNs;
+    }
+    timer->expires = (tick > wheel->now) ? tick : wheel->now + 1;
+    timer_file(wheel, timer);
+    wheel->count++;
+}
+
+/* void timer_cancel(TimerWheel* wheel, Timer* timer)
+* -----------------------------------------------
+* Cancels a timer. Does nothing if it is not pending.
+*
+* wheel: the TimerWheel the timer was added to
+* timer: the Timer to cancel
+*/
+void timer_cancel(TimerWheel* wheel, Timer* timer) {
+    if (timer_pending(timer)) {
+        timer_unlink(wheel, timer);
+    }
+}
+
+/* int timer_wheel_advance(TimerWheel* wheel, uint64_t nowNs)
+* -----------------------------------------------
+* Processes every tick up to nowNs, calling the functions of the timers that
+* expire. Timers may be added or cancelled (including ones due in the same
+* tick) from those functions.
+*
+* wheel: the TimerWheel to advance
+* nowNs: the current time in ns
+*
+* Returns: the number of timers that expired
+*/
+int timer_wheel_advance(TimerWheel* wheel, uint64_t nowNs) {
+    if (nowNs < wheel->originNs) {
+        return 0;
+    }
+    uint64_t target = (nowNs - wheel->originNs) / wheel->tickNs;
+    int fired = 0;
+    while (wheel->now < target) {
+        if (wheel->count == 0) {
+            wheel->now = target; // Nothing to cascade or expire
+            break;
+        }
+        uint64_t tick = ++wheel->now;
+        // Move timers down from the higher levels whose slot has come round,
+        // highest first so they can fall more than one level
+        for (int level = TIMER_LEVELS - 1; level > 0; level--) {
+            int shift = TIMER_BITS * level;
+            if ((tick & ((1ULL << shift) - 1)) == 0) {
+                timer_cascade(wheel, level, (tick >> shift) & TIMER_MASK);
+            }
+        }
+        Timer** slot = &wheel->slots[0][tick & TIMER_MASK];
+        Timer* timer;
+        while ((timer = *slot)) {
+            timer_unlink(wheel, timer);
+            fired++;
+            timer->fire(timer, timer->arg);
+        }
+    }
+    return fired;
+}
+
+/* uint64_t timer_wheel_next(TimerWheel* wheel)
+* -----------------------------------------------
+* Finds when timer_wheel_advance() next needs to be called: the next tick
+* with a timer in the lowest level, or the next time a higher level slot
+* comes round if that is sooner. Looks at no more than TIMER_SLOTS slots.
+*
+* wheel: the TimerWheel to check
+*
+* Returns: the time in ns, or UINT64_MAX if there are no pending timers
+*/
+uint64_t timer_wheel_next(TimerWheel* wheel) {
+    if (wheel->count == 0) {
+        return UINT64_MAX;
+    }
+    uint64_t tick = wheel->now + 1;
+    while ((tick & TIMER_MASK) != 0 && !wheel->slots[0][tick & TIMER_MASK]) {
+        tick++;
+    }
+    return wheel->originNs + tick * wheel->tickNs;
+}
+
+/* static void timer_file(TimerWheel* wheel, Timer* timer)
+* -----------------------------------------------
+* Links a timer into the slot for its expiry tick, in the lowest level in
+* which its expiry and the current tick fall in the same turn of the level
+* above. The slot it goes in then comes round no later than it expires.
+*
+* wheel: the TimerWheel
+* timer: the Timer, whose expiry is not before the current tick
+*/
+static void timer_file(TimerWheel* wheel, Timer* timer) {
+    int level = 0;
+    while (level < TIMER_LEVELS - 1
+            && (timer->expires >> (TIMER_BITS * (level + 1)))
+            != (wheel->now >> (TIMER_BITS * (level + 1)))) {
+        level++;
+    }
+    Timer** slot = &wheel->slots[level]
+            [(timer->expires >> (TIMER_BITS * level)) & TIMER_MASK];
+    timer->next = *slot;
+    if (timer->next) {
+        timer->next->prev = &timer->next;
+    }
+    timer->prev = slot;
+    *slot = timer;
+}
+
+/* static void timer_unlink(TimerWheel* wheel, Timer* timer)
+* -----------------------------------------------
+* Removes a pending timer from its slot
+*
+* wheel: the TimerWheel
+* timer: the Timer
+*/
+static void timer_unlink(TimerWheel* wheel, Timer* timer) {
+    *timer->prev = timer->next;
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    timer->next = NULL;
+    timer->prev = NULL;
+    wheel->count--;
+}
+
+/* static void timer_cascade(TimerWheel* wheel, int level, int slot)
+* -----------------------------------------------
+* Re-files every timer in a slot that has come round, which moves them to a
+* lower level (or back to the top level for timers beyond its span)
+*
+* wheel: the TimerWheel
+* level: level of the slot
+* slot: index of the slot
+*/
+static void timer_cascade(TimerWheel* wheel, int level, int slot) {
+    Timer* timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    while (timer) {
+        Timer* next = timer->next;
+        timer_file(wheel, timer);
+        timer = next;
+    }
+}
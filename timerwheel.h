@@ -0,0 +1,76 @@
+// timerwheel.h
+// Author: Rohith Kotia Palakirti
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+// Each level of the wheel has 1 << TIMER_BITS slots
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+// Levels in the wheel, each covering TIMER_SLOTS times the span of the one
+// below it. Timers further out than the top level wait there and are
+// re-filed each time its slot comes round.
+#define TIMER_LEVELS 4
+
+struct Timer;
+
+/* TimerFunc
+* -----------------------------------------------
+* Function called when a timer expires. The timer is no longer pending when
+* it is called, so it may be added again.
+*/
+typedef void (*TimerFunc)(struct Timer* timer, void* arg);
+
+/* Timer Struct
+* -----------------------------------------------
+* A single timer, embedded in the structure that owns it so adding and
+* cancelling it never allocates
+* next: next timer in the same slot
+* prev: the pointer that points to this timer, NULL if it is not pending
+* expires: tick at which the timer expires
+* fire: function called when the timer expires
+* arg: passed to fire
+*/
+typedef struct Timer {
+    struct Timer* next;
+    struct Timer** prev;
+    uint64_t expires;
+    TimerFunc fire;
+    void* arg;
+} Timer;
+
+/* TimerWheel Struct
+* -----------------------------------------------
+* Hierarchical timing wheel. Timers are filed by expiry tick in a slot of
+* the lowest level whose span covers them, and move down a level each time
+* the slot they are in comes round, so adding, cancelling and expiring a
+* timer are all O(1).
+* tickNs: length of a tick in ns
+* originNs: time (ns) of tick 0
+* now: the last tick processed
+* count: number of pending timers
+* slots: the timers in each slot of each level, as doubly linked lists
+*/
+typedef struct TimerWheel {
+    uint64_t tickNs;
+    uint64_t originNs;
+    uint64_t now;
+    int count;
+    Timer* slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+/*
+ * Function Prototypes
+ */
+void timer_wheel_init(TimerWheel* wheel, uint64_t tickNs, uint64_t nowNs);
+void timer_init(Timer* timer, TimerFunc fire, void* arg);
+int timer_pending(Timer* timer);
+void timer_add(TimerWheel* wheel, Timer* timer, uint64_t whenNs);
+void timer_cancel(TimerWheel* wheel, Timer* timer);
+int timer_wheel_advance(TimerWheel* wheel, uint64_t nowNs);
+uint64_t timer_wheel_next(TimerWheel* wheel);
+
+#endif